@@ -9,6 +9,7 @@
 /** @file
  *
  * minimal example filesystem using high-level API
+ * (or the low-level API with --lowlevel)
  *
  * Compile with:
  *
@@ -20,8 +21,10 @@
 
 
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -29,6 +32,11 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 /*
  * Command line options
@@ -41,68 +49,550 @@ static struct options {
 	const char *filename;
 	const char *contents;
 	int show_help;
+	int write_buffer;
+	int lowlevel;
+	int cache;
+	int writeback;
+	double timeout;
+	int trace;
+	const char *image;
+	int dedup;
+	int compress;
 } options;
 
-char msg[1024];
-FILE *fp;
-char msg_tmp[1024];
+/*
+ * Tracing
+ *
+ * A traced operation leaves one fixed-size binary record in a ring owned
+ * by the calling thread, a background thread drains the rings into
+ * TRACE_FILE. Producers never block or lock; when a ring is full the
+ * record is dropped and counted. trace_level selects what is recorded
+ * (--trace=<n>, or at runtime setxattr TRACE_XATTR on any node):
+ *   0 nothing, 1 one record per request, 2 engine events as well
+ */
+#define TRACE_ON 1
+#define TRACE_FILE "/fuse_result"
+#define TRACE_XATTR "user.hello.trace"
+#define TRACE_RING 4096		/* records per thread, a power of two */
+#define TRACE_PERIOD 50000	/* drain interval in us when idle */
+
+enum trace_op{
+	TR_INIT = 1, TR_LOOKUP, TR_FORGET, TR_GETATTR, TR_SETATTR, TR_READDIR,
+	TR_OPEN, TR_READ, TR_WRITE, TR_FLUSH, TR_FSYNC, TR_RELEASE,
+	TR_MKNOD, TR_MKDIR, TR_CREATE, TR_UNLINK, TR_RMDIR, TR_RENAME,
+	TR_STATFS, TR_SETXATTR, TR_UTIMENS, TR_READDIRPLUS, TR_FALLOCATE,
+	TR_LSEEK,
+	TR_NOPS,
+	/* level 2 */
+	TR_BANK_WRITE = 64, TR_WC_FLUSH, TR_NO_SPACE, TR_COMMIT,
+};
+
+/* brief: one record of TRACE_FILE, host byte order */
+struct trace_rec{
+	uint64_t time;		/* CLOCK_MONOTONIC ns when the operation ended */
+	uint64_t ino;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t latency;	/* ns, saturated; 0 for level 2 events */
+	uint32_t tid;
+	uint16_t op;		/* enum trace_op */
+	int16_t res;		/* 0 or a negative errno */
+};
+
+/* brief: single producer (the owning thread), single consumer ring */
+struct trace_ring{
+	struct trace_ring *next;
+	uint32_t head;		/* next slot the owner fills */
+	uint32_t tail;		/* next slot the drain reads */
+	uint32_t dropped;
+	uint32_t tid;
+	int dead;		/* owner exited, freed once drained */
+	struct trace_rec rec[TRACE_RING];
+};
+
+int trace_level;
+__thread struct trace_ring *trace_ring;
+struct trace_ring *trace_rings;
+uint32_t trace_dropped_gone;	/* dropped by rings already freed */
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;	/* guards the ring list */
+pthread_key_t trace_key;
+pthread_t trace_thread;
+int trace_running, trace_stop;
+
+uint64_t trace_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_emit(uint64_t t0, int op, uint64_t ino, uint64_t offset, size_t size, int res){
+	struct trace_ring *r = trace_ring;
+	uint64_t now = trace_now();
+	if (r == NULL){
+		r = calloc(1, sizeof(struct trace_ring));
+		if (r == NULL) return;
+		r -> tid = gettid();
+		pthread_mutex_lock(&trace_lock);
+		r -> next = trace_rings;
+		trace_rings = r;
+		pthread_mutex_unlock(&trace_lock);
+		pthread_setspecific(trace_key, r);
+		trace_ring = r;
+	}
+	if (r -> head - __atomic_load_n(&r -> tail, __ATOMIC_ACQUIRE) == TRACE_RING){
+		__atomic_add_fetch(&r -> dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct trace_rec *t = &r -> rec[r -> head & (TRACE_RING - 1)];
+	t -> time = now;
+	t -> ino = ino;
+	t -> offset = offset;
+	t -> size = size > UINT32_MAX ? UINT32_MAX : size;
+	t -> latency = t0 == 0 ? 0 : now - t0 > UINT32_MAX ? UINT32_MAX : now - t0;
+	t -> tid = r -> tid;
+	t -> op = op;
+	t -> res = res < 0 ? res : 0;
+	__atomic_store_n(&r -> head, r -> head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Statistics
+ *
+ * Every request is also counted, whatever the trace level, in counters
+ * owned by the calling thread: calls, errors, bytes moved (the size of
+ * a successful request) and a log-linear latency histogram. Reading
+ * STATS_NAME in the root sums them up. The histogram has STATS_SUB
+ * buckets per power of two of nanoseconds, so a percentile is off by at
+ * most 1/STATS_SUB.
+ */
+#define STATS_NAME ".stats"
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 36	/* 2^36 ns (~69 s) and up share the last bucket */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+struct op_stats{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t hist[STATS_BUCKETS];
+};
+
+/* brief: written by the owning thread only, read with atomic loads */
+struct thread_stats{
+	struct thread_stats *next;
+	struct op_stats op[TR_NOPS];
+};
+
+static const char *const trace_op_name[TR_NOPS] = {
+	[TR_INIT] = "init", [TR_LOOKUP] = "lookup", [TR_FORGET] = "forget",
+	[TR_GETATTR] = "getattr", [TR_SETATTR] = "setattr", [TR_READDIR] = "readdir",
+	[TR_OPEN] = "open", [TR_READ] = "read", [TR_WRITE] = "write",
+	[TR_FLUSH] = "flush", [TR_FSYNC] = "fsync", [TR_RELEASE] = "release",
+	[TR_MKNOD] = "mknod", [TR_MKDIR] = "mkdir", [TR_CREATE] = "create",
+	[TR_UNLINK] = "unlink", [TR_RMDIR] = "rmdir", [TR_RENAME] = "rename",
+	[TR_STATFS] = "statfs", [TR_SETXATTR] = "setxattr", [TR_UTIMENS] = "utimens",
+	[TR_READDIRPLUS] = "readdirplus", [TR_FALLOCATE] = "fallocate",
+	[TR_LSEEK] = "lseek",
+};
+
+__thread struct thread_stats *thread_stats;
+struct thread_stats *stats_threads;
+struct op_stats stats_gone[TR_NOPS];	/* what exited threads counted */
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;	/* guards the list and stats_gone */
+pthread_key_t stats_key;
+
+#define STAT_ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+uint32_t stats_bucket(uint64_t ns){
+	int e;
+	if (ns < STATS_SUB) return ns;
+	if (ns >> STATS_MAX_BITS) return STATS_BUCKETS - 1;
+	e = 63 - __builtin_clzll(ns);
+	return (e - STATS_SUB_BITS + 1) * STATS_SUB + ((ns >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* brief: smallest latency in ns that lands in bucket b */
+uint64_t stats_bucket_low(uint32_t b){
+	if (b < STATS_SUB) return b;
+	return (uint64_t)(STATS_SUB + b % STATS_SUB) << (b / STATS_SUB - 1);
+}
 
-#define DEBUG_ON 1
+void stats_add(int op, uint64_t ns, size_t size, int res){
+	struct thread_stats *s = thread_stats;
+	struct op_stats *o;
+	if (s == NULL){
+		s = calloc(1, sizeof(struct thread_stats));
+		if (s == NULL) return;
+		pthread_mutex_lock(&stats_lock);
+		s -> next = stats_threads;
+		stats_threads = s;
+		pthread_mutex_unlock(&stats_lock);
+		pthread_setspecific(stats_key, s);
+		thread_stats = s;
+	}
+	o = &s -> op[op];
+	STAT_ADD(o -> count, 1);
+	if (res < 0) STAT_ADD(o -> errors, 1);
+	else STAT_ADD(o -> bytes, size);
+	STAT_ADD(o -> ns, ns);
+	STAT_ADD(o -> hist[stats_bucket(ns)], 1);
+}
+
+/* brief: thread exit, fold the thread's counters into stats_gone */
+void stats_thread_exit(void *arg){
+	struct thread_stats *s = arg, **p;
+	int i, b;
+	pthread_mutex_lock(&stats_lock);
+	for (p = &stats_threads;*p != s;p = &(*p) -> next);
+	*p = s -> next;
+	for (i = 0;i < TR_NOPS;i++){
+		stats_gone[i].count += s -> op[i].count;
+		stats_gone[i].errors += s -> op[i].errors;
+		stats_gone[i].bytes += s -> op[i].bytes;
+		stats_gone[i].ns += s -> op[i].ns;
+		for (b = 0;b < STATS_BUCKETS;b++)
+			stats_gone[i].hist[b] += s -> op[i].hist[b];
+	}
+	pthread_mutex_unlock(&stats_lock);
+	free(s);
+}
+
+/* brief: sum of every thread's counters into sum[TR_NOPS] */
+void stats_sum(struct op_stats *sum){
+	struct thread_stats *s;
+	int i, b;
+	pthread_mutex_lock(&stats_lock);
+	memcpy(sum, stats_gone, sizeof(stats_gone));
+	for (s = stats_threads;s != NULL;s = s -> next){
+		for (i = 0;i < TR_NOPS;i++){
+			struct op_stats *o = &s -> op[i];
+			sum[i].count += __atomic_load_n(&o -> count, __ATOMIC_RELAXED);
+			sum[i].errors += __atomic_load_n(&o -> errors, __ATOMIC_RELAXED);
+			sum[i].bytes += __atomic_load_n(&o -> bytes, __ATOMIC_RELAXED);
+			sum[i].ns += __atomic_load_n(&o -> ns, __ATOMIC_RELAXED);
+			for (b = 0;b < STATS_BUCKETS;b++)
+				sum[i].hist[b] += __atomic_load_n(&o -> hist[b], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* brief: latency in ns below which a fraction q of o's calls finished,
+ * rounded up to the end of its bucket */
+uint64_t stats_percentile(struct op_stats *o, double q){
+	uint64_t want = (uint64_t)(q * o -> count + 0.999999), seen = 0;
+	uint32_t b;
+	if (want == 0) want = 1;
+	for (b = 0;b < STATS_BUCKETS - 1;b++){
+		seen += o -> hist[b];
+		if (seen >= want) break;
+	}
+	return b == STATS_BUCKETS - 1 ? stats_bucket_low(b) : stats_bucket_low(b + 1) - 1;
+}
 
-#ifdef DEBUG_ON
-	#define DEBUG_FILE "/fuse_result"
-	#define DEBUG(x) {sprintf(msg,"%s",x); fwrite(msg, strlen(msg), 1, fp);	fflush(fp);}
-	#define DEBUG_INT(x) {sprintf(msg_tmp," %d\t",(int)x);DEBUG(msg_tmp);}
-	#define DEBUG_END() {sprintf(msg,"\n"); fwrite(msg, strlen(msg), 1, fp);	fflush(fp);}
+/* brief: close an operation opened with TRACE_BEGIN, size is the bytes
+ * it moved (or the count of what it handled) */
+void trace_end(uint64_t t0, int op, uint64_t ino, uint64_t offset, size_t size, int res){
+	stats_add(op, trace_now() - t0, size, res);
+#ifdef TRACE_ON
+	if (__builtin_expect(__atomic_load_n(&trace_level, __ATOMIC_RELAXED) >= 1, 0))
+		trace_emit(t0, op, ino, offset, size, res);
+#endif
+}
+
+#define TRACE_BEGIN() trace_now()
+#define TRACE_END(t0, op, ino, off, size, res) trace_end(t0, op, ino, off, size, res)
+#ifdef TRACE_ON
+	#define TRACE_EVENT(op, ino, off, size, res) do { if (__builtin_expect(__atomic_load_n(&trace_level, __ATOMIC_RELAXED) >= 2, 0)) trace_emit(0, op, ino, off, size, res); } while (0)
 #else
-	#define DEBUG(x) {}
-	#define DEBUG_INT(x) {}
-	#define DEBUG_END() {}
+	#define TRACE_EVENT(op, ino, off, size, res) do {} while (0)
 #endif
 
+void trace_ring_exit(void *arg){
+	struct trace_ring *r = arg;
+	__atomic_store_n(&r -> dead, 1, __ATOMIC_RELEASE);
+}
+
+/* brief: one pass over every ring, returns the number of records moved */
+size_t trace_drain(FILE **out){
+	struct trace_ring **p, *r;
+	size_t n = 0;
+	pthread_mutex_lock(&trace_lock);
+	for (p = &trace_rings;(r = *p) != NULL;){
+		int dead = __atomic_load_n(&r -> dead, __ATOMIC_ACQUIRE);
+		uint32_t head = __atomic_load_n(&r -> head, __ATOMIC_ACQUIRE), tail = r -> tail;
+		if (head != tail && *out == NULL) *out = fopen(TRACE_FILE, "w");
+		for (;tail != head;tail++, n++)
+			if (*out != NULL) fwrite(&r -> rec[tail & (TRACE_RING - 1)], sizeof(struct trace_rec), 1, *out);
+		__atomic_store_n(&r -> tail, tail, __ATOMIC_RELEASE);
+		if (dead){
+			*p = r -> next;
+			trace_dropped_gone += __atomic_load_n(&r -> dropped, __ATOMIC_RELAXED);
+			free(r);
+		} else {
+			p = &r -> next;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	if (n > 0 && *out != NULL) fflush(*out);
+	return n;
+}
+
+void *trace_main(void *arg){
+	FILE *out = NULL;
+	while (!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE))
+		if (trace_drain(&out) == 0) usleep(TRACE_PERIOD);
+	trace_drain(&out);
+	if (out != NULL) fclose(out);
+	return NULL;
+}
+
+void trace_init(void){
+	pthread_key_create(&trace_key, trace_ring_exit);
+	trace_stop = 0;
+	if (pthread_create(&trace_thread, NULL, trace_main, NULL) == 0)
+		trace_running = 1;
+}
+
+/* brief: write out what is left and stop the drain */
+void trace_exit(void){
+	if (!trace_running) return;
+	__atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(trace_thread, NULL);
+	trace_running = 0;
+}
+
+/* brief: TRACE_XATTR carries the new level as decimal text, any other
+ * name is accepted and ignored like before */
+int trace_setxattr(const char *name, const char *value, size_t size){
+	char buf[16];
+	if (strcmp(name, TRACE_XATTR) != 0) return 0;
+	if (size == 0 || size >= sizeof(buf)) return -EINVAL;
+	memcpy(buf, value, size);
+	buf[size] = 0;
+	__atomic_store_n(&trace_level, atoi(buf), __ATOMIC_RELAXED);
+	return 0;
+}
+
 #define FILE_NAME_LEN 1024
 #define TOTAL_SIZE ((uint64_t)1024*1024*1024*2) // totol size of fsdemo
 #define BANK_SIZE (1024*1024*4)
 #define BANK_NUM (TOTAL_SIZE/BANK_SIZE)
 #define CHUNK_SIZE (1024*16)
 #define CHUNK_NUM (TOTAL_SIZE/CHUNK_SIZE)
+#define CHUNK_PER_BANK (BANK_SIZE/CHUNK_SIZE)
 
-struct context{
-	int chunk_index;
-	size_t size;
-	struct context * next;
+#define NDIRECT 12
+#define SLOT_PER_CHUNK (CHUNK_SIZE / sizeof(uint32_t))
+#define MAX_BLOCKS (NDIRECT + SLOT_PER_CHUNK + SLOT_PER_CHUNK * SLOT_PER_CHUNK)
+#define MAX_FILE_SIZE ((uint64_t)MAX_BLOCKS * CHUNK_SIZE)
+
+#define INLINE_MAX ((NDIRECT + 2) * sizeof(uint32_t))
+
+/* brief: radix block map, logical chunk -> chunk index
+ * slot value 0 means "no chunk" (chunk 0 is never handed out)
+ * blocks [0, NDIRECT) sit in the inode, the next SLOT_PER_CHUNK go
+ * through one map chunk, the rest through a two level map chunk
+ * a file of at most INLINE_MAX bytes keeps them here instead, it gets
+ * chunks when it grows past that (inode inlined) */
+struct blockmap{
+	union{
+		struct{
+			uint32_t direct[NDIRECT];
+			uint32_t ind;
+			uint32_t dind;
+		};
+		char bytes[INLINE_MAX];
+	};
 };
 
+struct open_file;
+
+/* Locking
+ * every inode has a rwlock: a directory's covers its son list and name
+ * index, a file's covers its block map, size, pending writes and data.
+ * Two inode locks are only ever held parent before child (rmdir, the
+ * target of a rename); a rename also takes rename_lock first, so the
+ * ancestor order between its two directories cannot change under it.
+ * refcnt keeps an inode alive once its directory lock is dropped: the
+ * directory entry, nlookup > 0, each open handle and each path walk in
+ * flight hold one reference, the last inode_put frees the inode. */
 struct inode{
-	char filename[FILE_NAME_LEN];
+	char *filename;		/* interned, see name_get */
+	fuse_ino_t ino;		/* index into the inode table, FUSE_ROOT_ID for root */
+	uint64_t generation;
+	uint64_t nlookup;	/* kernel references (low-level API only) */
+	int refcnt;
+	pthread_rwlock_t lock;
 	size_t size;
 	time_t timeLastModified;
 	char isDirectories;	
-	struct context* context;
-	struct inode *son;
+	char readonly;		/* part of a snapshot, never changes */
+	char inlined;		/* data in map.bytes, size <= INLINE_MAX */
+	struct blockmap map;
+	struct inode *father;
+	struct inode *son;	/* first entry, entries are kept in insertion order */
 	struct inode *bro;
+	struct inode *prev;	/* previous sibling, NULL for the first son */
+	struct inode *hnext;	/* next entry in the father's hash bucket */
+	uint32_t hash;		/* hash of filename */
+	uint64_t dpos;		/* readdir cookie in the father, see dir_insert */
+	/* directories only: name index over the son/bro list */
+	struct inode **bucket;
+	uint32_t nbucket;
+	uint32_t nentry;
+	struct inode *last_son;
+	uint64_t dseq;		/* entries ever linked, for their cookies */
+	struct inode *dhint;	/* where the last readdir stopped, see dir_seek */
+	struct open_file *wc_owner;	/* handle holding buffered writes */
 };
-struct inode_list{
-	struct inode_list *next;
-	char isDirectories;
-	char filename[FILE_NAME_LEN];
+
+/* brief: fuse_file_info fh of a regular file opened with --write-buffer */
+struct open_file{
+	struct inode *inode;	/* referenced for the lifetime of the handle */
+	off_t wc_off;
+	size_t wc_len;
+	size_t wc_cap;
+	size_t wc_size;		/* file size before the pending run */
+	int wc_err;		/* a failed flush, for the next flush, fsync or release */
+	char *wc;
 };
 struct inode *root;
+struct inode *stats_inode;	/* read-only STATS_NAME in the root */
+#define SNAP_NAME ".snapshots"
+struct inode *snap_inode;	/* SNAP_NAME in the root, a directory per snapshot */
+int bank_fd;		/* memfd holding every bank back to back */
+char *bank_base;
 void *bank[BANK_NUM];
-char bitmap[CHUNK_NUM];
-char *local_buf;
+/* inode numbers: ino_pages[ino / INO_PAGE][ino % INO_PAGE] is the inode,
+ * pages never move so lookups take no lock; freed numbers are reused
+ * with a new generation so (ino, generation) never repeats */
+#define INO_PAGE 4096
+#define INO_PAGES 4096
+struct inode **ino_pages[INO_PAGES];
+size_t ino_next = FUSE_ROOT_ID;
+fuse_ino_t *ino_free;
+size_t ino_nfree, ino_free_cap;
+uint64_t ino_generation;
+pthread_mutex_t ino_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+uint16_t bank_used[BANK_NUM];	/* chunks of each bank owned by files */
+char bank_open[BANK_NUM];	/* bank is mapped read/write */
+pthread_mutex_t bank_lock = PTHREAD_MUTEX_INITIALIZER;
+/* chunk allocator: bit set = chunk in use (or reserved by a thread cache)
+ * chunk_full has one bit per chunk_bits word, set when the word is full
+ * the bitmap is cut into shards with a lock each, every thread starts
+ * its searches in its own home shard */
+#define CHUNK_SHARDS 16
+#define SHARD_CHUNKS (CHUNK_NUM / CHUNK_SHARDS)
+uint64_t chunk_bits_mem[CHUNK_NUM / 64];
+uint64_t *chunk_bits = chunk_bits_mem;	/* inside the image with --image */
+uint64_t chunk_full[CHUNK_NUM / 64 / 64];
+size_t chunk_free;	/* chunks not owned by any file, cached ones included */
+/* owners of a data chunk besides the first, a chunk shared with a
+ * snapshot is copied before it is written; map chunks are never shared */
+uint32_t chunk_share[CHUNK_NUM];
+size_t chunk_shared;	/* chunks with chunk_share > 0 */
+struct chunk_shard{
+	pthread_mutex_t lock;
+	uint32_t hint;
+} chunk_shard[CHUNK_SHARDS];
+uint32_t chunk_shard_next;
+pthread_key_t chunk_cache_key;
 
-struct attr{
-	int size;
-	time_t timeLastModified;
+/* brief: per-thread reserved run [next, end), single chunk requests and
+ * goal-directed extends are served from it without touching the bitmap */
+#define CHUNK_CACHE_RUN 64
+struct chunk_cache{
+	uint32_t next;
+	uint32_t end;
+	uint32_t home;		/* home shard + 1, 0 until the first refill */
+};
+__thread struct chunk_cache chunk_cache;
+
+/*
+ * Image (--image=<file>)
+ *
+ * The banks, the chunk bitmap and a table of on-disk inodes live in one
+ * file mapped shared, so whatever the engine writes is in the file's page
+ * cache right away and outlives the daemon. The file is sparse, only
+ * touched chunks and inode pages take space:
+ *   [0, TOTAL_SIZE)	banks, bank_fd positions are the same as without
+ *   IMAGE_SUPER	struct image_super
+ *   IMAGE_BITMAP	chunk_bits
+ *   IMAGE_INODES	struct dinode, indexed by inode number
+ * Every namespace, size or block map change is written through to the
+ * inode's slot. A mount rebuilds the tree from the table; the bitmap is
+ * only trusted after a clean unmount, else it is recomputed from the
+ * block maps.
+ */
+#define IMAGE_MAGIC "HELLOIMG"
+#define IMAGE_VERSION 3
+#define IMAGE_SUPER TOTAL_SIZE
+#define IMAGE_BITMAP (IMAGE_SUPER + 4096)
+#define IMAGE_INODES (IMAGE_BITMAP + CHUNK_NUM / 8)
+#define IMAGE_SLOTS ((uint64_t)INO_PAGE * INO_PAGES)
+#define IMAGE_SIZE (IMAGE_INODES + IMAGE_SLOTS * sizeof(struct dinode))
+#define DINODE_NAME 160
+
+struct image_super{
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t total_size;
+	uint64_t ino_slots;
+	uint32_t dinode_size;
+	uint32_t clean;		/* unmounted cleanly, chunk_bits is exact */
+	uint64_t ino_next;	/* no slot at or above this is in use */
+	uint64_t checkpoint_seq;	/* last journal group the image contains */
+};
+
+/* brief: slot ino of the inode table, 256 bytes; parent 0 = free slot
+ * a name of DINODE_NAME bytes or more is kept in a chunk of its own */
+struct dinode{
+	uint64_t generation;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t parent;
+	uint32_t name_chunk;
+	struct blockmap map;
+	uint16_t namelen;
 	char isDirectories;
+	char readonly;
+	char inlined;
+	char pad[3];
+	char name[DINODE_NAME];
 };
 
+int image_fd = -1;
+struct image_super *image_sb;
+struct dinode *image_inodes;	/* set once the tree is restored */
+
+void journal_begin(void);
+void journal_end(void);
+int journal_sync(void);
+void journal_map(struct inode *head, uint32_t *slot);
+void journal_zero(uint32_t c);
+void journal_revoke(uint32_t c);
+void compress_start(void);
+void compress_end(void);
+
 #define OPTION(t, p)                           \
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("--name=%s", filename),
 	OPTION("--contents=%s", contents),
+	OPTION("--write-buffer=%d", write_buffer),
+	OPTION("--lowlevel", lowlevel),
+	OPTION("--cache", cache),
+	OPTION("--writeback", writeback),
+	OPTION("--timeout=%lf", timeout),
+	OPTION("--trace=%d", trace),
+	OPTION("--image=%s", image),
+	OPTION("--dedup", dedup),
+	OPTION("--compress=%d", compress),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
@@ -130,447 +620,3532 @@ void deal(const char *path, char *dirname, char *filename){
 	filename[k] = 0;
 }
 
-struct inode *get_father_inode(char *dirname){
-	struct inode *head = root;
-	char s[FILE_NAME_LEN];
-	int i = 1, j, is_find = 0;
-	if (strlen(dirname) == 1)
-		return head;
-	int len = strlen(dirname);
-	if (dirname[len - 1] != '/'){
-		dirname[len] = '/';
-		dirname[len + 1] = 0;
-	}
-	while (1){
-		head = head -> son;
-		if (head == NULL) break;
-		j = 0;
-		while (1){
-			s[j++] = dirname[i++];
-			if (dirname[i] == '/'){
-				s[j] = 0;
-				while (1){
-					if (strcmp(head -> filename,s) == 0){
-						is_find = 1;
-						break;
-					}
-					head = head -> bro;
-					if (head == NULL) return NULL;
-				}
-			}
-			if (is_find == 1){
-				is_find = 0;
-				if (!dirname[i + 1]){
-					is_find = 1;
-				}
-				break;
+/*
+ * Metadata slabs
+ *
+ * Inodes, open handles and names are cut out of
+ * SLAB_PAGE pages, a pool per object size. A freed object goes on its
+ * pool's free list and is handed out again before a new page is cut,
+ * so create and unlink reach neither malloc nor free once the pools
+ * have grown to the working set. Pages are never given back.
+ */
+#define SLAB_PAGE (64 * 1024)
+#define SLAB_ALIGN 16
+struct slab{
+	pthread_mutex_t lock;
+	size_t size;		/* object size, a multiple of SLAB_ALIGN */
+	void *free;		/* freed objects, linked through their first word */
+	char *cur;		/* uncut rest of the last page */
+	size_t left;
+	size_t nobj;		/* objects handed out */
+	size_t npage;
+};
+#define SLAB_SIZE(n) (((n) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+#define SLAB_INIT(type) { PTHREAD_MUTEX_INITIALIZER, SLAB_SIZE(sizeof(type)), NULL, NULL, 0, 0, 0 }
+struct slab inode_slab = SLAB_INIT(struct inode);
+struct slab open_file_slab = SLAB_INIT(struct open_file);
+
+/* brief: a zeroed object of s, NULL when no page can be had */
+void *slab_alloc(struct slab *s){
+	void *p;
+	pthread_mutex_lock(&s -> lock);
+	if ((p = s -> free) != NULL){
+		s -> free = *(void **)p;
+	} else {
+		if (s -> left < s -> size){
+			if ((s -> cur = malloc(SLAB_PAGE)) == NULL){
+				s -> left = 0;
+				pthread_mutex_unlock(&s -> lock);
+				return NULL;
 			}
+			s -> left = SLAB_PAGE;
+			s -> npage++;
 		}
-		if (!dirname[++i]) break;
+		p = s -> cur;
+		s -> cur += s -> size;
+		s -> left -= s -> size;
 	}
-	if (is_find == 1){
-		return head;
+	s -> nobj++;
+	pthread_mutex_unlock(&s -> lock);
+	memset(p, 0, s -> size);
+	return p;
+}
+
+void slab_free(struct slab *s, void *p){
+	if (p == NULL) return;
+	pthread_mutex_lock(&s -> lock);
+	*(void **)p = s -> free;
+	s -> free = p;
+	s -> nobj--;
+	pthread_mutex_unlock(&s -> lock);
+}
+
+/*
+ * Names
+ *
+ * Entry names are interned: each distinct name is kept once, with a
+ * count of the inodes holding it, so a snapshot or a tree of
+ * index.html files pays for the string once. An inode's filename
+ * points at the str of its struct name; the name's pool is picked by
+ * its length.
+ */
+struct name{
+	struct name *next;	/* hash chain */
+	uint32_t hash;		/* name_hash of str */
+	uint32_t refcnt;
+	uint32_t len;
+	char str[];
+};
+#define NAME_CLASSES (SLAB_SIZE(sizeof(struct name) + FILE_NAME_LEN) / SLAB_ALIGN)
+struct slab name_slab[NAME_CLASSES];
+struct name **name_table;
+size_t name_nbucket, name_count;
+pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t name_hash(const char *name, size_t len);
+
+struct name *name_of(const char *str){
+	return (struct name *)(str - offsetof(struct name, str));
+}
+
+void name_init(void){
+	size_t i;
+	for (i = 0;i < NAME_CLASSES;i++){
+		pthread_mutex_init(&name_slab[i].lock, NULL);
+		name_slab[i].size = (i + 1) * SLAB_ALIGN;
 	}
-	return NULL;
 }
 
+struct slab *name_pool(size_t len){
+	return &name_slab[SLAB_SIZE(sizeof(struct name) + len + 1) / SLAB_ALIGN - 1];
+}
 
-int getFreeChunk(){
-	int i = 0;
-	for (;i < CHUNK_NUM;i++){
-		if (bitmap[i] == 1) continue;
-		break;
+void name_rehash(size_t nbucket){
+	struct name **table = calloc(nbucket, sizeof(struct name *)), *n, *next;
+	size_t i;
+	if (table == NULL) return;
+	for (i = 0;i < name_nbucket;i++){
+		for (n = name_table[i];n != NULL;n = next){
+			next = n -> next;
+			n -> next = table[n -> hash & (nbucket - 1)];
+			table[n -> hash & (nbucket - 1)] = n;
+		}
 	}
-	if (i == CHUNK_NUM){
-		DEBUG("No space for free chunk");
-		DEBUG_END();
+	free(name_table);
+	name_table = table;
+	name_nbucket = nbucket;
+}
+
+/* brief: the interned copy of the len bytes at str, referenced; NULL
+ * when out of memory. Release it with name_put */
+char *name_get(const char *str, size_t len){
+	uint32_t h = name_hash(str, len);
+	struct name *n;
+	pthread_mutex_lock(&name_lock);
+	if (name_count >= name_nbucket) name_rehash(name_nbucket ? name_nbucket * 2 : 1024);
+	for (n = name_table[h & (name_nbucket - 1)];n != NULL;n = n -> next){
+		if (n -> hash == h && n -> len == len && memcmp(n -> str, str, len) == 0){
+			n -> refcnt++;
+			pthread_mutex_unlock(&name_lock);
+			return n -> str;
+		}
 	}
-	bitmap[i] = 1;
-	DEBUG("get free chunk = ");
-	DEBUG_INT(i);
-	DEBUG_END();
-	return i;
+	pthread_mutex_unlock(&name_lock);
+	/* the pools lock on their own, a name racing in meanwhile is kept twice */
+	if ((n = slab_alloc(name_pool(len))) == NULL) return NULL;
+	n -> hash = h;
+	n -> refcnt = 1;
+	n -> len = len;
+	memcpy(n -> str, str, len);
+	n -> str[len] = 0;
+	pthread_mutex_lock(&name_lock);
+	n -> next = name_table[h & (name_nbucket - 1)];
+	name_table[h & (name_nbucket - 1)] = n;
+	name_count++;
+	pthread_mutex_unlock(&name_lock);
+	return n -> str;
 }
 
-static void *hello_init(struct fuse_conn_info *conn,
-			struct fuse_config *cfg)
-{	
-	//(void) conn;
-	//cfg->kernel_cache = 1;
-	DEBUG("begin init");
-	DEBUG_END();
-	int init_bank_i;
-	for (init_bank_i = 0;init_bank_i < BANK_NUM;init_bank_i++){
-		bank[init_bank_i] = malloc(BANK_SIZE);
-	}
-	root = (struct inode*) malloc(sizeof(struct inode));
-	root -> bro = NULL;
-	root -> son = NULL;
-	root -> isDirectories = 1;
-	root -> size = 0;
-	root -> timeLastModified = time(NULL);
-	memset(root -> filename, 0,FILE_NAME_LEN);
-	root -> filename[0] = '/';
-	memset(bitmap, 0,sizeof(bitmap));
-	return NULL;
+void name_put(char *str){
+	struct name *n, **p;
+	if (str == NULL) return;
+	n = name_of(str);
+	pthread_mutex_lock(&name_lock);
+	if (--n -> refcnt > 0){
+		pthread_mutex_unlock(&name_lock);
+		return;
+	}
+	for (p = &name_table[n -> hash & (name_nbucket - 1)];*p != n;p = &(*p) -> next);
+	*p = n -> next;
+	name_count--;
+	pthread_mutex_unlock(&name_lock);
+	slab_free(name_pool(n -> len), n);
 }
 
-int GetAttr(const char *path,struct attr *attr){
-	char filename[FILE_NAME_LEN];
-	int len = strlen(path);
-	strcpy(filename, path);
-	filename[len] = '/';
-	filename[len + 1] = 0;
-	struct inode* head = get_father_inode(filename);
-	if (head == NULL) return -1;
-	attr -> isDirectories = head -> isDirectories;
-	attr -> size = head -> size;
-	attr -> timeLastModified = head -> timeLastModified;
+size_t name_len(const char *str){
+	return name_of(str) -> len;
+}
+
+/* brief: memory the slab pools hold, in use or free */
+size_t slab_bytes(void){
+	size_t n = __atomic_load_n(&inode_slab.npage, __ATOMIC_RELAXED) +
+		   __atomic_load_n(&open_file_slab.npage, __ATOMIC_RELAXED);
+	size_t i;
+	for (i = 0;i < NAME_CLASSES;i++)
+		n += __atomic_load_n(&name_slab[i].npage, __ATOMIC_RELAXED);
+	return n * SLAB_PAGE;
+}
+
+int ino_alloc(struct inode *now){
+	struct inode **page;
+	pthread_mutex_lock(&ino_lock);
+	if (ino_nfree > 0){
+		now -> ino = ino_free[--ino_nfree];
+		now -> generation = ++ino_generation;
+	} else {
+		if (ino_next >= (size_t)INO_PAGE * INO_PAGES){
+			pthread_mutex_unlock(&ino_lock);
+			return -ENOSPC;
+		}
+		if (ino_pages[ino_next / INO_PAGE] == NULL){
+			page = calloc(INO_PAGE, sizeof(struct inode *));
+			__atomic_store_n(&ino_pages[ino_next / INO_PAGE], page, __ATOMIC_RELEASE);
+		}
+		now -> ino = ino_next;
+		now -> generation = ino_generation;
+		__atomic_store_n(&ino_next, ino_next + 1, __ATOMIC_RELEASE);
+		if (image_sb != NULL && ino_next > image_sb -> ino_next)
+			image_sb -> ino_next = ino_next;
+	}
+	__atomic_store_n(&ino_pages[now -> ino / INO_PAGE][now -> ino % INO_PAGE], now, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ino_lock);
 	return 0;
 }
 
-static int hello_getattr(const char *path, struct stat *stbuf,
-			 struct fuse_file_info *fi)
-{
-	/* (void) fi;
-	int res = 0;
+void ino_release(struct inode *now){
+	pthread_mutex_lock(&ino_lock);
+	__atomic_store_n(&ino_pages[now -> ino / INO_PAGE][now -> ino % INO_PAGE], NULL, __ATOMIC_RELEASE);
+	if (ino_nfree == ino_free_cap){
+		ino_free_cap = ino_free_cap ? ino_free_cap * 2 : 1024;
+		ino_free = realloc(ino_free, ino_free_cap * sizeof(fuse_ino_t));
+	}
+	ino_free[ino_nfree++] = now -> ino;
+	pthread_mutex_unlock(&ino_lock);
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else if (strcmp(path+1, options.filename) == 0) {
-		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_nlink = 1;
-		stbuf->st_size = strlen(options.contents);
-	} else
-		res = -ENOENT;
+struct inode *ino_lookup(fuse_ino_t ino){
+	if (ino == 0 || ino >= __atomic_load_n(&ino_next, __ATOMIC_ACQUIRE)) return NULL;
+	struct inode **page = __atomic_load_n(&ino_pages[ino / INO_PAGE], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&page[ino % INO_PAGE], __ATOMIC_ACQUIRE);
+}
 
-	return res; */
-	DEBUG("begin getattr");
-	DEBUG_END();
-	struct attr attr;
-	int ret = 0;
-	if (strlen(path) == 1){
-		attr.size = 0;
-		attr.isDirectories = root -> isDirectories;
-		attr.timeLastModified = root -> timeLastModified;
-	} else {
-		ret = GetAttr(path, &attr);
+/* brief: a new inode holds one reference, the one of its directory entry */
+struct inode *new_inode(const char *filename, char isDirectories){
+	struct inode *now = slab_alloc(&inode_slab);
+	if (now == NULL) return NULL;
+	if ((now -> filename = name_get(filename, strlen(filename))) == NULL){
+		slab_free(&inode_slab, now);
+		return NULL;
 	}
-	if (ret < 0){
-		return -2;
+	now -> isDirectories = isDirectories;
+	now -> inlined = isDirectories != 1;	/* an empty file has no chunks */
+	now -> timeLastModified = time(NULL);
+	now -> refcnt = 1;
+	pthread_rwlock_init(&now -> lock, NULL);	/* inode_tryget may see it once it has a number */
+	if (ino_alloc(now) < 0){
+		pthread_rwlock_destroy(&now -> lock);
+		name_put(now -> filename);
+		slab_free(&inode_slab, now);
+		return NULL;
 	}
-	if (attr.isDirectories == 1){
-		stbuf -> st_mode = S_IFDIR | 0666;
-		stbuf -> st_size = 0;
-	} else {
-		stbuf -> st_mode = S_IFREG | 0777;
-		stbuf -> st_size = attr.size;
+	return now;
+}
+
+void FreeInode(struct inode *head);
+void image_data(struct inode *head);
+void image_clear(struct inode *head);
+
+/* root is never freed and every path walk starts there, so it is not counted */
+void inode_get(struct inode *head){
+	if (head != root) __atomic_add_fetch(&head -> refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void inode_put(struct inode *head){
+	if (head == NULL || head == root) return;
+	if (__atomic_sub_fetch(&head -> refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		FreeInode(head);
+}
+
+/* brief: reference to inode ino for a walker that comes through no
+ * directory, NULL when there is none or its last reference is gone;
+ * ino_lock keeps FreeInode from releasing it meanwhile */
+struct inode *inode_tryget(fuse_ino_t ino){
+	struct inode *head;
+	int n;
+	pthread_mutex_lock(&ino_lock);
+	head = ino_lookup(ino);
+	if (head != NULL && head != root){
+		n = __atomic_load_n(&head -> refcnt, __ATOMIC_RELAXED);
+		do {
+			if (n == 0){
+				head = NULL;
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(&head -> refcnt, &n, n + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 	}
-	stbuf->st_nlink = 1;            /* Count of links, set default one link. */
-    stbuf->st_uid = 0;              /* User ID, set default 0. */
-    stbuf->st_gid = 0;              /* Group ID, set default 0. */
-    stbuf->st_rdev = 0;             /* Device ID for special file, set default 0. */
-    stbuf->st_atime = 0;            /* Time of last access, set default 0. */
-    stbuf->st_mtime = attr.timeLastModified; /* Time of last modification, set default 0. */
-    stbuf->st_ctime = 0;            /* Time of last creation or status change, set default 0. */
-	return 0;
+	pthread_mutex_unlock(&ino_lock);
+	return head;
 }
 
-int ReadDir(const char *path,struct inode_list *Li){
-	char filename[FILE_NAME_LEN];
-	struct inode_list *list = NULL;
-	int len = strlen(path);
-	Li -> isDirectories = -1;
-	Li -> next = NULL;
-	struct inode* head;
-	if (len != 1){
-		strcpy(filename, path);
-		head = get_father_inode(filename);
-	} else head = root;
-	if (head == NULL) return -1;
-	head = head -> son;
-	if (head != NULL){
-		Li -> isDirectories = head -> isDirectories;
-		strcpy(Li -> filename, head -> filename);
-		Li -> next = NULL;
-		head = head -> bro;
-	}
-	list = Li;
+uint32_t name_hash(const char *name, size_t len){
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0;i < len;i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct inode *dir_lookup(struct inode *dir, const char *name, size_t len){
+	if (dir -> nbucket == 0) return NULL;
+	uint32_t h = name_hash(name, len);
+	struct inode *now = dir -> bucket[h & (dir -> nbucket - 1)];
+	for (;now != NULL;now = now -> hnext){
+		if (now -> hash == h && strncmp(now -> filename, name, len) == 0 && now -> filename[len] == 0)
+			return now;
+	}
+	return NULL;
+}
+
+void dir_rehash(struct inode *dir, uint32_t nbucket){
+	struct inode **bucket = calloc(nbucket, sizeof(struct inode *));
+	struct inode *now;
+	for (now = dir -> son;now != NULL;now = now -> bro){
+		now -> hnext = bucket[now -> hash & (nbucket - 1)];
+		bucket[now -> hash & (nbucket - 1)] = now;
+	}
+	free(dir -> bucket);
+	dir -> bucket = bucket;
+	dir -> nbucket = nbucket;
+}
+
+/* Readdir cookies
+ * "." and ".." are 1 and 2, an entry gets the next cookie of its
+ * directory when it is linked and keeps it until it is unlinked. The
+ * son list is in insertion order, so cookies grow along it and a
+ * readdir at offset off resumes at the first entry above off; entries
+ * linked or removed meanwhile neither shift nor repeat the others. */
+#define DIR_POS_FIRST 3
+
+/* brief: link now as the last son of dir and index its name */
+void dir_insert(struct inode *dir, struct inode *now){
+	now -> father = dir;
+	now -> hash = name_of(now -> filename) -> hash;
+	now -> dpos = DIR_POS_FIRST + dir -> dseq++;
+	now -> bro = NULL;
+	now -> prev = dir -> last_son;
+	if (dir -> last_son != NULL) dir -> last_son -> bro = now;
+	else dir -> son = now;
+	dir -> last_son = now;
+	dir -> nentry++;
+	if (dir -> nentry > dir -> nbucket){
+		dir_rehash(dir, dir -> nbucket ? dir -> nbucket * 2 : 8);
+		return;
+	}
+	now -> hnext = dir -> bucket[now -> hash & (dir -> nbucket - 1)];
+	dir -> bucket[now -> hash & (dir -> nbucket - 1)] = now;
+}
+
+void dir_remove(struct inode *dir, struct inode *now){
+	struct inode **p = &dir -> bucket[now -> hash & (dir -> nbucket - 1)];
+	while (*p != now) p = &(*p) -> hnext;
+	*p = now -> hnext;
+	if (now -> prev != NULL) now -> prev -> bro = now -> bro;
+	else dir -> son = now -> bro;
+	if (now -> bro != NULL) now -> bro -> prev = now -> prev;
+	else dir -> last_son = now -> prev;
+	if (__atomic_load_n(&dir -> dhint, __ATOMIC_RELAXED) == now)
+		__atomic_store_n(&dir -> dhint, now -> bro, __ATOMIC_RELAXED);
+	now -> bro = now -> prev = now -> hnext = NULL;
+	dir -> nentry--;
+}
+
+/* brief: first entry of dir with a cookie above off, NULL past the
+ * end; dir is locked. Where the last readdir stopped is tried before
+ * walking the list, so paging through a directory is linear overall */
+struct inode *dir_seek(struct inode *dir, off_t off){
+	struct inode *now = __atomic_load_n(&dir -> dhint, __ATOMIC_RELAXED);
+	if (now != NULL && now -> dpos > (uint64_t)off && (now -> prev == NULL || now -> prev -> dpos <= (uint64_t)off))
+		return now;
+	for (now = dir -> son;now != NULL && now -> dpos <= (uint64_t)off;now = now -> bro);
+	return now;
+}
+
+/* brief: the next readdir of dir will likely resume at now; readers
+ * race on it under the read lock, any linked entry is a fine hint */
+void dir_stop(struct inode *dir, struct inode *now){
+	__atomic_store_n(&dir -> dhint, now, __ATOMIC_RELAXED);
+}
+
+/* brief: take now out of the namespace for good, a directory must be
+ * locked as well so nothing gets created in it meanwhile */
+void dir_unlink(struct inode *dir, struct inode *now){
+	dir_remove(dir, now);
+	__atomic_store_n(&now -> father, NULL, __ATOMIC_RELEASE);
+	dir -> timeLastModified = time(NULL);
+	journal_begin();
+	image_clear(now);
+	image_data(dir);
+	journal_end();
+}
+
+/* brief: dir was removed, nothing may be linked into it any more
+ * stable while dir is locked, removal locks the directory itself */
+int dir_dead(struct inode *dir){
+	return dir != root && __atomic_load_n(&dir -> father, __ATOMIC_ACQUIRE) == NULL;
+}
+
+/* brief: dir_lookup under the directory's read lock, the entry comes
+ * back referenced so it stays valid after the lock is dropped */
+struct inode *dir_get(struct inode *dir, const char *name, size_t len){
+	pthread_rwlock_rdlock(&dir -> lock);
+	struct inode *now = dir_lookup(dir, name, len);
+	if (now != NULL) inode_get(now);
+	pthread_rwlock_unlock(&dir -> lock);
+	return now;
+}
+
+/* brief: walk path from root one hashed component at a time
+ * a trailing '/' is accepted, NULL when any component is missing
+ * the result is referenced, callers inode_put it when done */
+struct inode *get_father_inode(const char *dirname){
+	struct inode *head = root, *next;
+	const char *p = dirname, *q;
 	while (head != NULL){
-		list -> next = malloc(sizeof(struct inode_list));
-		list = list -> next;
-		list -> isDirectories = head -> isDirectories;
-		strcpy(list -> filename, head -> filename);
-		list -> next = NULL;
-		head = head -> bro;
+		while (*p == '/') p++;
+		if (*p == 0) return head;
+		if (head -> isDirectories != 1) break;
+		for (q = p;*q != 0 && *q != '/';q++);
+		next = dir_get(head, p, q - p);
+		inode_put(head);
+		head = next;
+		p = q;
 	}
-	return 0;
+	inode_put(head);
+	return NULL;
 }
 
-static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi,
-			 enum fuse_readdir_flags flags)
-{
-	/* (void) offset;
-	(void) fi;
-	(void) flags;
+struct inode *get_inode(const char *path){
+	return get_father_inode(path);
+}
 
-	DEBUG(path);
 
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
+/* brief: address of a chunk inside its bank, no copy involved */
+char *chunk_addr(int chunk_index){
+	return (char *)bank[chunk_index / CHUNK_PER_BANK] + (size_t)(chunk_index % CHUNK_PER_BANK) * CHUNK_SIZE;
+}
 
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
-	filler(buf, options.filename, NULL, 0, 0);
+/* brief: open bank b for access, banks are only reserved address space
+ * until a chunk in them is handed out */
+void bank_map(uint32_t b){
+	if (!__atomic_load_n(&bank_open[b], __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&bank_lock);
+		if (!bank_open[b]){
+			mprotect(bank[b], BANK_SIZE, PROT_READ | PROT_WRITE);
+			__atomic_store_n(&bank_open[b], 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&bank_lock);
+	}
+}
 
-	return 0; */
+void bank_get(uint32_t c, size_t n){
+	while (n > 0){
+		uint32_t b = c / CHUNK_PER_BANK;
+		size_t k = CHUNK_PER_BANK - c % CHUNK_PER_BANK;
+		if (k > n) k = n;
+		bank_map(b);
+		__atomic_add_fetch(&bank_used[b], k, __ATOMIC_RELAXED);
+		c += k;
+		n -= k;
+	}
+}
 
-	DEBUG("begin readdir");
-	DEBUG_END();
-	struct inode_list list,*tmp;
-	struct stat st;
-	ReadDir(path, &list);
-	tmp = &list;
-	if (tmp -> isDirectories == -1) return 0;
-	for (;tmp != NULL;tmp = tmp -> next){
-		memset(&st, 0,sizeof(st));
-		st.st_mode = (tmp -> isDirectories == 1) ? S_IFDIR : S_IFMT;
-		if (filler(buf, tmp -> filename, &st, 0, 0)) break;
+void chunk_mark(uint32_t c, size_t n){
+	for (;n > 0;c++, n--){
+		chunk_bits[c >> 6] |= 1ULL << (c & 63);
+		if (chunk_bits[c >> 6] == ~0ULL)
+			chunk_full[c >> 12] |= 1ULL << ((c >> 6) & 63);
 	}
-	return 0;
+}
+
+void chunk_unmark(uint32_t c, size_t n){
+	for (;n > 0;c++, n--){
+		chunk_bits[c >> 6] &= ~(1ULL << (c & 63));
+		chunk_full[c >> 12] &= ~(1ULL << ((c >> 6) & 63));
+	}
+}
+
+/* brief: first free chunk of shard s at or after from, wrapping around
+ * inside the shard, -1 if it is full; caller holds the shard lock */
+long chunk_find_zero(uint32_t s, uint32_t from){
+	size_t w = from >> 6, i, l1;
+	size_t l1_first = (size_t)s * (SHARD_CHUNKS / 4096), nl1 = SHARD_CHUNKS / 4096;
+	uint64_t free_bits = ~chunk_bits[w] & (~0ULL << (from & 63));
+	if (free_bits)
+		return (w << 6) + __builtin_ctzll(free_bits);
+	for (i = 0;i <= nl1;i++){
+		l1 = l1_first + ((w >> 6) - l1_first + i) % nl1;
+		uint64_t words = ~chunk_full[l1];
+		if (i == 0) words &= (w & 63) == 63 ? 0 : ~0ULL << ((w & 63) + 1);
+		if (i == nl1) words &= ~(~0ULL << (w & 63));
+		if (words == 0) continue;
+		w = (l1 << 6) + __builtin_ctzll(words);
+		return (w << 6) + __builtin_ctzll(~chunk_bits[w]);
+	}
+	free_bits = ~chunk_bits[w] & ~(~0ULL << (from & 63));
+	if (free_bits)
+		return (w << 6) + __builtin_ctzll(free_bits);
+	return -1;
+}
+
+/* brief: number of free chunks starting at c, at most n, runs end at
+ * the shard boundary; caller holds the shard lock */
+size_t chunk_zero_run(uint32_t c, size_t n){
+	size_t got = 0, end = (c / SHARD_CHUNKS + 1) * SHARD_CHUNKS;
+	while (got < n && c < end){
+		uint64_t used = chunk_bits[c >> 6] >> (c & 63);
+		size_t span = 64 - (c & 63);
+		size_t len = used ? (size_t)__builtin_ctzll(used) : span;
+		if (len > span) len = span;
+		got += len;
+		c += len;
+		if (len < span) break;
+	}
+	return got < n ? got : n;
+}
+
+/* brief: reserve a free run of up to n chunks anywhere, returns its start
+ * the home shard is tried first, the thread moves home when it is full */
+long chunk_take_run(size_t n, size_t *got){
+	struct chunk_cache *cache = &chunk_cache;
+	uint32_t i, s;
+	long c = -1;
+	if (cache -> home == 0)
+		cache -> home = __atomic_fetch_add(&chunk_shard_next, 1, __ATOMIC_RELAXED) % CHUNK_SHARDS + 1;
+	for (i = 0;i < CHUNK_SHARDS && c < 0;i++){
+		s = (cache -> home - 1 + i) % CHUNK_SHARDS;
+		struct chunk_shard *sh = &chunk_shard[s];
+		pthread_mutex_lock(&sh -> lock);
+		c = chunk_find_zero(s, sh -> hint);
+		if (c >= 0){
+			*got = chunk_zero_run(c, n);
+			chunk_mark(c, *got);
+			sh -> hint = c + *got;
+			if (sh -> hint == (s + 1) * SHARD_CHUNKS) sh -> hint = s * SHARD_CHUNKS;
+			cache -> home = s + 1;
+		}
+		pthread_mutex_unlock(&sh -> lock);
+	}
+	return c;
+}
+
+void chunk_cache_drop(void *arg){
+	struct chunk_cache *cache = arg;
+	if (cache -> next < cache -> end){
+		struct chunk_shard *sh = &chunk_shard[cache -> next / SHARD_CHUNKS];
+		pthread_mutex_lock(&sh -> lock);
+		chunk_unmark(cache -> next, cache -> end - cache -> next);
+		pthread_mutex_unlock(&sh -> lock);
+	}
+	cache -> next = cache -> end = 0;
+}
+
+/* brief: allocate up to n contiguous chunks, preferably starting at goal
+ * (the chunk after the file's previous block, 0 for no preference)
+ * returns the first chunk and the run length in *got, -1 when full
+ * the thread's cached run is private, only refills lock a shard */
+long alloc_chunks(uint32_t goal, size_t n, size_t *got){
+	struct chunk_cache *cache = &chunk_cache;
+	long c = -1;
+	if (n == 0) n = 1;
+	*got = 0;
+	if (goal != 0 && goal == cache -> next && cache -> next < cache -> end){
+		c = cache -> next;
+		*got = cache -> end - cache -> next;
+		if (*got > n) *got = n;
+		cache -> next += *got;
+	} else if (goal != 0 && goal < CHUNK_NUM){
+		struct chunk_shard *sh = &chunk_shard[goal / SHARD_CHUNKS];
+		pthread_mutex_lock(&sh -> lock);
+		if ((*got = chunk_zero_run(goal, n)) > 0){
+			c = goal;
+			chunk_mark(c, *got);
+		}
+		pthread_mutex_unlock(&sh -> lock);
+	}
+	if (c < 0 && n <= cache -> end - cache -> next){
+		c = cache -> next;
+		*got = n;
+		cache -> next += n;
+	} else if (c < 0 && n >= CHUNK_CACHE_RUN){
+		c = chunk_take_run(n, got);
+		if (c < 0) return -1;
+	} else if (c < 0){
+		size_t run;
+		chunk_cache_drop(cache);
+		c = chunk_take_run(CHUNK_CACHE_RUN, &run);
+		if (c < 0) return -1;
+		pthread_setspecific(chunk_cache_key, cache);
+		*got = run < n ? run : n;
+		cache -> next = c + *got;
+		cache -> end = c + run;
+	}
+	__atomic_sub_fetch(&chunk_free, *got, __ATOMIC_RELAXED);
+	bank_get(c, *got);
+	return c;
+}
+
+int getFreeChunk(){
+	size_t got;
+	long c = alloc_chunks(0, 1, &got);
+	if (c < 0)
+		TRACE_EVENT(TR_NO_SPACE, 0, 0, 1, -ENOSPC);
+	return c;
+}
+
+/* brief: free a run of chunks and hand their pages back to the kernel
+ * the pages go while the chunks are still marked, so a new owner never
+ * loses data; banks stay open once touched, sealing one again would
+ * race with chunks other threads hold in their caches
+ * a free chunk reads as zeros, an image on a file system that cannot
+ * punch holes gets them written */
+void putChunks(uint32_t c, size_t n){
+	uint32_t b;
+	if (madvise(chunk_addr(c), n * CHUNK_SIZE, MADV_REMOVE) < 0)
+		memset(chunk_addr(c), 0, n * CHUNK_SIZE);
+	__atomic_add_fetch(&chunk_free, n, __ATOMIC_RELAXED);
+	while (n > 0){
+		size_t k = SHARD_CHUNKS - c % SHARD_CHUNKS;
+		if (k > n) k = n;
+		for (b = c / CHUNK_PER_BANK;b <= (c + k - 1) / CHUNK_PER_BANK;b++){
+			uint32_t lo = b * CHUNK_PER_BANK > c ? b * CHUNK_PER_BANK : c;
+			uint32_t hi = (b + 1) * CHUNK_PER_BANK < c + k ? (b + 1) * CHUNK_PER_BANK : c + k;
+			__atomic_sub_fetch(&bank_used[b], hi - lo, __ATOMIC_RELAXED);
+		}
+		struct chunk_shard *sh = &chunk_shard[c / SHARD_CHUNKS];
+		pthread_mutex_lock(&sh -> lock);
+		chunk_unmark(c, k);
+		pthread_mutex_unlock(&sh -> lock);
+		c += k;
+		n -= k;
+	}
+}
+
+void putChunk(uint32_t c){
+	putChunks(c, 1);
+}
+
+void chunk_share_add(uint32_t c){
+	if (__atomic_fetch_add(&chunk_share[c], 1, __ATOMIC_RELAXED) == 0)
+		__atomic_add_fetch(&chunk_shared, 1, __ATOMIC_RELAXED);
+}
+
+/* brief: drop one owner of data chunk c, 0 when it was the last one and
+ * the caller has to free the chunk */
+int chunk_unshare(uint32_t c){
+	uint32_t n = __atomic_load_n(&chunk_share[c], __ATOMIC_RELAXED);
+	do {
+		if (n == 0) return 0;
+	} while (!__atomic_compare_exchange_n(&chunk_share[c], &n, n - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if (n == 1) __atomic_sub_fetch(&chunk_shared, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Deduplication (--dedup)
+ *
+ * A chunk that a write fills completely is fingerprinted and looked up
+ * in an index of the full chunks written before it. When an identical
+ * one is found (compared byte for byte) the block becomes one more owner
+ * of it and the fresh chunk goes back. A chunk leaves the index when it
+ * is about to be written in place or loses its last owner, both decided
+ * under the bucket lock that matches take too, so every chunk in the
+ * index is owned and unchanged. The index is kept in memory only, after
+ * a mount just new writes are matched.
+ */
+#define DEDUP_BUCKETS (CHUNK_NUM / 4)
+#define DEDUP_LOCKS 64
+uint32_t *dedup_head;		/* bucket -> first chunk, 0 ends a chain */
+uint32_t *dedup_next;		/* chunk -> next chunk of its bucket */
+uint64_t *dedup_fp;		/* chunk -> fingerprint */
+uint64_t *dedup_bits;		/* chunk is in the index */
+pthread_mutex_t dedup_lock[DEDUP_LOCKS];	/* by bucket */
+size_t dedup_hits;		/* blocks that took an indexed chunk */
+
+void dedup_init(void){
+	int i;
+	dedup_head = calloc(DEDUP_BUCKETS, sizeof(uint32_t));
+	dedup_next = calloc(CHUNK_NUM, sizeof(uint32_t));
+	dedup_fp = calloc(CHUNK_NUM, sizeof(uint64_t));
+	dedup_bits = calloc(CHUNK_NUM / 64, sizeof(uint64_t));
+	for (i = 0;i < DEDUP_LOCKS;i++)
+		pthread_mutex_init(&dedup_lock[i], NULL);
+}
+
+/* brief: two independent multiply-rotate lanes over the chunk's words,
+ * a match is confirmed with memcmp so speed matters more than quality */
+uint64_t chunk_fingerprint(const char *p){
+	const uint64_t *w = (const uint64_t *)p;
+	uint64_t h = 0x9e3779b97f4a7c15ULL, g = 0xc2b2ae3d27d4eb4fULL;
+	size_t i;
+	for (i = 0;i < CHUNK_SIZE / sizeof(uint64_t);i += 2){
+		h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+		h = h << 31 | h >> 33;
+		g = (g ^ w[i + 1]) * 0xc4ceb9fe1a85ec53ULL;
+		g = g << 27 | g >> 37;
+	}
+	return h ^ (g * 0x94d049bb133111ebULL);
+}
+
+int dedup_has(uint32_t c){
+	return __atomic_load_n(&dedup_bits[c >> 6], __ATOMIC_ACQUIRE) >> (c & 63) & 1;
+}
+
+/* brief: take c out of bucket b, caller holds the bucket's lock */
+void dedup_remove(uint32_t c, uint32_t b){
+	uint32_t *p;
+	for (p = &dedup_head[b];*p != 0 && *p != c;p = &dedup_next[*p]);
+	if (*p != c) return;
+	*p = dedup_next[c];
+	__atomic_and_fetch(&dedup_bits[c >> 6], ~(1ULL << (c & 63)), __ATOMIC_RELEASE);
+}
+
+/* brief: chunk_unshare that keeps the index right, an indexed chunk
+ * leaves it with its last owner */
+int dedup_unshare(uint32_t c){
+	uint32_t b;
+	int res;
+	if (dedup_bits == NULL || !dedup_has(c)) return chunk_unshare(c);
+	b = dedup_fp[c] % DEDUP_BUCKETS;
+	pthread_mutex_lock(&dedup_lock[b % DEDUP_LOCKS]);
+	if ((res = chunk_unshare(c)) == 0) dedup_remove(c, b);
+	pthread_mutex_unlock(&dedup_lock[b % DEDUP_LOCKS]);
+	return res;
+}
+
+/* brief: the owner of c is about to write to it, true when c is shared
+ * and has to be copied first; one written in place leaves the index */
+int dedup_shared(uint32_t c){
+	uint32_t b;
+	int res;
+	if (dedup_bits == NULL || !dedup_has(c)) return __atomic_load_n(&chunk_share[c], __ATOMIC_ACQUIRE) != 0;
+	b = dedup_fp[c] % DEDUP_BUCKETS;
+	pthread_mutex_lock(&dedup_lock[b % DEDUP_LOCKS]);
+	if ((res = __atomic_load_n(&chunk_share[c], __ATOMIC_ACQUIRE) != 0) == 0) dedup_remove(c, b);
+	pthread_mutex_unlock(&dedup_lock[b % DEDUP_LOCKS]);
+	return res;
+}
+
+/* brief: indexed chunk holding what c holds, which then gets one more
+ * owner, or 0 after c itself was indexed */
+uint32_t dedup_match(uint32_t c){
+	uint64_t fp = chunk_fingerprint(chunk_addr(c));
+	uint32_t b = fp % DEDUP_BUCKETS, x;
+	pthread_mutex_lock(&dedup_lock[b % DEDUP_LOCKS]);
+	for (x = dedup_head[b];x != 0;x = dedup_next[x])
+		if (dedup_fp[x] == fp && x != c && memcmp(chunk_addr(x), chunk_addr(c), CHUNK_SIZE) == 0)
+			break;
+	if (x != 0){
+		chunk_share_add(x);
+	} else if (!dedup_has(c)){
+		dedup_fp[c] = fp;
+		dedup_next[c] = dedup_head[b];
+		dedup_head[b] = c;
+		__atomic_or_fetch(&dedup_bits[c >> 6], 1ULL << (c & 63), __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dedup_lock[b % DEDUP_LOCKS]);
+	return x;
+}
+
+/*
+ * Compression (--compress=<seconds>)
+ *
+ * A thread looks for data chunks that have not been written for the
+ * given number of seconds and compresses them (LZ77 with LZ4-style
+ * tokens and lengths; not the LZ4 block format, whose end of block
+ * rules it does not keep) into pack chunks. A packed block takes a run
+ * of PACK_UNIT byte units of a pack, a length word and then the
+ * compressed bytes, and its slot holds PACKED | pack << PACK_SLOT_BITS
+ * | first unit.
+ * Only a block that shrinks to PACK_LIMIT or less is packed, shared
+ * and indexed chunks are left alone. pack_refs counts the slots naming
+ * a pack, the last one frees it; the space of a dropped block inside a
+ * live pack is not reused. Reads decompress through a small direct
+ * mapped cache, a write gives the block a chunk of its own first
+ * (map_own), as it does for a shared chunk.
+ */
+#define PACKED 0x80000000u
+#define PACK_UNIT 64
+#define PACK_SLOT_BITS 8	/* CHUNK_SIZE / PACK_UNIT units per pack */
+#define PACK_LIMIT (CHUNK_SIZE * 3 / 4)
+#define UNPACK_SLOTS 64
+#define LZ_HASH_BITS 12
+uint32_t pack_refs[CHUNK_NUM];	/* slots naming each pack chunk */
+size_t pack_chunks;		/* chunks holding packed blocks */
+size_t packed_blocks;		/* blocks packed since the mount */
+size_t unpack_misses;		/* decompressions, cache hits excluded */
+uint32_t chunk_wtime[CHUNK_NUM];	/* last write in seconds, kept with --compress;
+					 * not in the image, a mount starts them at its time */
+struct unpack_slot{
+	pthread_mutex_t lock;
+	uint32_t value;		/* packed slot value decompressed in data, 0 if none */
+	char data[CHUNK_SIZE];
+} *unpack_cache;
+
+void compress_init(void){
+	int i;
+	unpack_cache = calloc(UNPACK_SLOTS, sizeof(struct unpack_slot));
+	for (i = 0;i < UNPACK_SLOTS;i++)
+		pthread_mutex_init(&unpack_cache[i].lock, NULL);
+}
+
+int is_packed(uint32_t v){
+	return (v & PACKED) != 0;
+}
+
+uint32_t pack_chunk(uint32_t v){
+	return (v & ~PACKED) >> PACK_SLOT_BITS;
+}
+
+char *pack_addr(uint32_t v){
+	return chunk_addr(pack_chunk(v)) + (v & ((1 << PACK_SLOT_BITS) - 1)) * PACK_UNIT;
+}
+
+void pack_get(uint32_t v){
+	__atomic_add_fetch(&pack_refs[pack_chunk(v)], 1, __ATOMIC_RELAXED);
+}
+
+/* brief: drop one slot naming the pack of v, the last one frees it and
+ * whatever the cache holds of it */
+void pack_put(uint32_t v){
+	uint32_t p = pack_chunk(v);
+	int i;
+	if (__atomic_sub_fetch(&pack_refs[p], 1, __ATOMIC_ACQ_REL) != 0) return;
+	for (i = 0;i < UNPACK_SLOTS;i++){
+		pthread_mutex_lock(&unpack_cache[i].lock);
+		if (is_packed(unpack_cache[i].value) && pack_chunk(unpack_cache[i].value) == p)
+			unpack_cache[i].value = 0;
+		pthread_mutex_unlock(&unpack_cache[i].lock);
+	}
+	__atomic_sub_fetch(&pack_chunks, 1, __ATOMIC_RELAXED);
+	putChunk(p);
+}
+
+/* brief: one LZ4-style sequence, literals then a match of mlen bytes at
+ * distance off (none when mlen is 0), -1 when out would overflow */
+int lz_emit(uint8_t **out, uint8_t *end, const uint8_t *lit, size_t nlit, size_t off, size_t mlen){
+	uint8_t *op = *out, *token;
+	size_t l;
+	if ((size_t)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1) return -1;
+	token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15){
+		for (l = nlit - 15;l >= 255;l -= 255) *op++ = 255;
+		*op++ = l;
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen > 0){
+		*op++ = off;
+		*op++ = off >> 8;
+		mlen -= 4;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15){
+			for (l = mlen - 15;l >= 255;l -= 255) *op++ = 255;
+			*op++ = l;
+		}
+	}
+	*out = op;
+	return 0;
+}
+
+/* brief: compress n bytes (n < 64k) into at most cap bytes, the length
+ * written or 0 when it does not fit */
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap){
+	uint16_t table[1 << LZ_HASH_BITS];
+	const uint8_t *base = (const uint8_t *)src, *ip = base, *anchor = base, *end = base + n;
+	uint8_t *op = (uint8_t *)dst;
+	uint32_t seq, h;
+	memset(table, 0, sizeof(table));
+	while (ip + 4 <= end){
+		memcpy(&seq, ip, 4);
+		h = seq * 2654435761u >> (32 - LZ_HASH_BITS);
+		const uint8_t *ref = base + table[h];
+		table[h] = ip - base;
+		if (ref < ip && memcmp(ref, ip, 4) == 0){
+			const uint8_t *m = ip + 4, *r = ref + 4;
+			while (m < end && *m == *r) m++, r++;
+			if (lz_emit(&op, (uint8_t *)dst + cap, anchor, ip - anchor, ip - ref, m - ip) < 0) return 0;
+			ip = anchor = m;
+		} else {
+			ip++;
+		}
+	}
+	if (lz_emit(&op, (uint8_t *)dst + cap, anchor, end - anchor, 0, 0) < 0) return 0;
+	return op - (uint8_t *)dst;
+}
+
+/* brief: read an LZ4-style length extension, -1 when the input ends in it */
+int lz_length(const uint8_t **ip, const uint8_t *end, size_t *len){
+	do {
+		if (*ip >= end) return -1;
+		*len += **ip;
+	} while (*(*ip)++ == 255);
+	return 0;
+}
+
+/* brief: decompress exactly n bytes, -1 on input that is damaged */
+int lz_decompress(const char *src, size_t len, char *dst, size_t n){
+	const uint8_t *ip = (const uint8_t *)src, *end = ip + len;
+	uint8_t *op = (uint8_t *)dst, *oend = op + n;
+	while (ip < end){
+		unsigned token = *ip++;
+		size_t l = token >> 4, off;
+		if (l == 15 && lz_length(&ip, end, &l) < 0) return -1;
+		if ((size_t)(end - ip) < l || (size_t)(oend - op) < l) return -1;
+		memcpy(op, ip, l);
+		op += l;
+		ip += l;
+		if (ip == end) break;
+		if (end - ip < 2) return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		l = token & 15;
+		if (l == 15 && lz_length(&ip, end, &l) < 0) return -1;
+		l += 4;
+		if (off == 0 || off > (size_t)(op - (uint8_t *)dst) || (size_t)(oend - op) < l) return -1;
+		if (off >= l){
+			memcpy(op, op - off, l);
+			op += l;
+		} else {
+			for (;l > 0;l--, op++) *op = op[-off];
+		}
+	}
+	return op == oend ? 0 : -1;
+}
+
+/* brief: copy size bytes at off out of packed block v */
+int unpack_read(uint32_t v, char *buf, size_t size, off_t off){
+	struct unpack_slot *u = &unpack_cache[(v * 2654435761u >> 16) % UNPACK_SLOTS];
+	uint32_t len;
+	pthread_mutex_lock(&u -> lock);
+	if (u -> value != v){
+		u -> value = 0;
+		memcpy(&len, pack_addr(v), sizeof(len));
+		if (len > CHUNK_SIZE - (v & ((1 << PACK_SLOT_BITS) - 1)) * PACK_UNIT - sizeof(len)
+		    || lz_decompress(pack_addr(v) + sizeof(len), len, u -> data, CHUNK_SIZE) < 0){
+			pthread_mutex_unlock(&u -> lock);
+			return -EIO;
+		}
+		u -> value = v;
+		__atomic_add_fetch(&unpack_misses, 1, __ATOMIC_RELAXED);
+	}
+	memcpy(buf, u -> data + off, size);
+	pthread_mutex_unlock(&u -> lock);
+	return 0;
+}
+
+/*
+ * Size classes
+ *
+ * Block 0 of a file that fits SUB_MAX bytes does not take a chunk but a
+ * block of the smallest class that holds it: 512 B, 2 KB or 8 KB, cut
+ * out of chunks that hold blocks of one class only. Its slot holds
+ * SUB | class << SUB_CLASS_SHIFT | chunk << 5 | block. As the file
+ * grows the block moves up a class, past SUB_MAX to a chunk of its own
+ * (map_fit); it never moves down. Each class keeps the chunks that
+ * still have a free block in a list, the last block going frees the
+ * chunk. Sub-blocks are never shared, a snapshot copies them.
+ * Files past a chunk grow in the runs the thread chunk caches hand out
+ * (CHUNK_CACHE_RUN), which map_run reads back as one extent.
+ */
+#define SUB 0x40000000u
+#define SUB_CLASS_SHIFT 28
+#define SUB_CLASSES 3
+#define SUB_MIN 512		/* class k holds SUB_MIN << 2k bytes */
+#define SUB_MAX (SUB_MIN << 2 * (SUB_CLASSES - 1))
+struct sub_class{
+	pthread_mutex_t lock;
+	uint32_t *partial;	/* chunks with a free block */
+	size_t npartial, cap;
+	size_t nblocks;		/* blocks in use */
+} sub_class[SUB_CLASSES];
+uint32_t sub_used[CHUNK_NUM];	/* blocks of a class chunk in use, a bit each */
+uint32_t sub_pos[CHUNK_NUM];	/* place in its class' partial list + 1, 0 if none */
+
+void sub_init(void){
+	int i;
+	for (i = 0;i < SUB_CLASSES;i++)
+		pthread_mutex_init(&sub_class[i].lock, NULL);
+}
+
+int is_sub(uint32_t v){
+	return (v & (PACKED | SUB)) == SUB;
+}
+
+int sub_cls(uint32_t v){
+	return (v >> SUB_CLASS_SHIFT) & 3;
+}
+
+uint32_t sub_chunk(uint32_t v){
+	return (v & ((1u << SUB_CLASS_SHIFT) - 1)) >> 5;
+}
+
+size_t sub_size(int cls){
+	return (size_t)SUB_MIN << 2 * cls;
+}
+
+/* brief: smallest class that holds size bytes, -1 when none does */
+int sub_fit(size_t size){
+	int cls;
+	for (cls = 0;cls < SUB_CLASSES;cls++)
+		if (size <= sub_size(cls)) return cls;
+	return -1;
+}
+
+/* brief: bank_fd position of the block a (non packed) slot value names */
+off_t block_pos(uint32_t v){
+	if (!is_sub(v)) return (off_t)v * CHUNK_SIZE;
+	return (off_t)sub_chunk(v) * CHUNK_SIZE + (v & 31) * sub_size(sub_cls(v));
+}
+
+char *block_addr(uint32_t v){
+	if (!is_sub(v)) return chunk_addr(v);
+	return chunk_addr(sub_chunk(v)) + (v & 31) * sub_size(sub_cls(v));
+}
+
+uint32_t sub_full(int cls){
+	size_t per = CHUNK_SIZE / sub_size(cls);
+	return per >= 32 ? ~0u : (1u << per) - 1;
+}
+
+void sub_list(struct sub_class *k, uint32_t c){
+	if (k -> npartial == k -> cap){
+		k -> cap = k -> cap ? k -> cap * 2 : 64;
+		k -> partial = realloc(k -> partial, k -> cap * sizeof(uint32_t));
+	}
+	k -> partial[k -> npartial++] = c;
+	sub_pos[c] = k -> npartial;
+}
+
+void sub_unlist(struct sub_class *k, uint32_t c){
+	uint32_t last = k -> partial[--k -> npartial];
+	k -> partial[sub_pos[c] - 1] = last;
+	sub_pos[last] = sub_pos[c];
+	sub_pos[c] = 0;
+}
+
+/* brief: a zeroed block of class cls, its slot value or 0 */
+uint32_t sub_alloc(int cls){
+	struct sub_class *k = &sub_class[cls];
+	uint32_t c, i, v;
+	pthread_mutex_lock(&k -> lock);
+	if (k -> npartial == 0){
+		int n = getFreeChunk();
+		if (n < 0){
+			pthread_mutex_unlock(&k -> lock);
+			return 0;
+		}
+		sub_used[n] = 0;
+		sub_list(k, n);
+	}
+	c = k -> partial[k -> npartial - 1];
+	i = __builtin_ctz(~sub_used[c]);
+	sub_used[c] |= 1u << i;
+	if (sub_used[c] == sub_full(cls)) sub_unlist(k, c);
+	__atomic_add_fetch(&k -> nblocks, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&k -> lock);
+	v = SUB | (uint32_t)cls << SUB_CLASS_SHIFT | c << 5 | i;
+	memset(block_addr(v), 0, sub_size(cls));
+	return v;
+}
+
+void sub_free(uint32_t v){
+	struct sub_class *k = &sub_class[sub_cls(v)];
+	uint32_t c = sub_chunk(v);
+	pthread_mutex_lock(&k -> lock);
+	if (sub_used[c] == sub_full(sub_cls(v))) sub_list(k, c);
+	sub_used[c] &= ~(1u << (v & 31));
+	__atomic_sub_fetch(&k -> nblocks, 1, __ATOMIC_RELAXED);
+	if (sub_used[c] != 0){
+		pthread_mutex_unlock(&k -> lock);
+		return;
+	}
+	sub_unlist(k, c);
+	pthread_mutex_unlock(&k -> lock);
+	putChunk(c);
+}
+
+/* brief: collects freed chunks into runs so putChunks sees few calls */
+struct free_run{
+	uint32_t start;
+	size_t n;
+};
+
+void free_run_add(struct free_run *run, uint32_t c){
+	if (run -> n != 0 && run -> start + run -> n == c){
+		run -> n++;
+		return;
+	}
+	if (run -> n != 0) putChunks(run -> start, run -> n);
+	run -> start = c;
+	run -> n = 1;
+}
+
+void free_run_end(struct free_run *run){
+	if (run -> n != 0) putChunks(run -> start, run -> n);
+	run -> n = 0;
+}
+
+/* brief: drop one owner of data chunk c, it joins run with the last one */
+void data_drop(struct free_run *run, uint32_t c){
+	if (is_packed(c)) pack_put(c);
+	else if (is_sub(c)) sub_free(c);
+	else if (!dedup_unshare(c)) free_run_add(run, c);
+}
+
+/* brief: one more owner of slot value c, a chunk or a packed block */
+void data_share(uint32_t c){
+	if (is_packed(c)) pack_get(c);
+	else chunk_share_add(c);
+}
+
+/* brief: slot of logical block blk, map chunks are created on demand
+ * when alloc is set, NULL when the block is past the mapped range */
+uint32_t *map_slot(struct inode *head, size_t blk, int alloc){
+	uint32_t *node, *up = NULL;
+	if (blk < NDIRECT) return &head -> map.direct[blk];
+	blk -= NDIRECT;
+	if (blk < SLOT_PER_CHUNK){
+		up = &head -> map.ind;
+	} else {
+		blk -= SLOT_PER_CHUNK;
+		if (blk >= SLOT_PER_CHUNK * SLOT_PER_CHUNK) return NULL;
+		up = &head -> map.dind;
+	}
+	if (*up == 0){
+		if (!alloc) return NULL;
+		int c = getFreeChunk();
+		if (c < 0) return NULL;
+		memset(chunk_addr(c), 0, CHUNK_SIZE);
+		journal_zero(c);
+		*up = c;
+	}
+	node = (uint32_t *)chunk_addr(*up);
+	if (up == &head -> map.ind) return &node[blk];
+	up = &node[blk / SLOT_PER_CHUNK];
+	if (*up == 0){
+		if (!alloc) return NULL;
+		int c = getFreeChunk();
+		if (c < 0) return NULL;
+		memset(chunk_addr(c), 0, CHUNK_SIZE);
+		journal_zero(c);
+		*up = c;
+		journal_map(head, up);
+	}
+	node = (uint32_t *)chunk_addr(*up);
+	return &node[blk % SLOT_PER_CHUNK];
+}
+
+uint32_t map_get(struct inode *head, size_t blk){
+	uint32_t *slot = map_slot(head, blk, 0);
+	return slot == NULL ? 0 : *slot;
+}
+
+/* brief: length of the physically contiguous run starting at blk
+ * (at most nmax blocks), its first chunk goes to *chunk; a packed
+ * block is a run of its own */
+size_t map_run(struct inode *head, size_t blk, size_t nmax, uint32_t *chunk){
+	size_t n = 1;
+	*chunk = map_get(head, blk);
+	if (*chunk == 0) return 0;
+	if (is_packed(*chunk) || is_sub(*chunk)) return 1;
+	while (n < nmax && map_get(head, blk + n) == *chunk + n) n++;
+	return n;
+}
+
+/* brief: the first block of [blk, end) that maps a chunk (data set) or
+ * is a hole (data clear), end if none is; a map chunk that is not
+ * there is a hole over all of its blocks and is skipped in one step */
+size_t map_seek(struct inode *head, size_t blk, size_t end, int data){
+	size_t first = NDIRECT + SLOT_PER_CHUNK;
+	for (;blk < end;blk++){
+		uint32_t *slot = map_slot(head, blk, 0);
+		if (slot != NULL ? (*slot != 0) == data : !data) return blk;
+		if (slot != NULL) continue;
+		if (blk < first) blk = first - 1;
+		else if (head -> map.dind == 0) break;
+		else blk += SLOT_PER_CHUNK - 1 - (blk - first) % SLOT_PER_CHUNK;
+	}
+	return end;
+}
+
+/* brief: where to look for a chunk for block blk, right after the
+ * chunk of the block before it; 0 (no preference) after a hole */
+uint32_t map_goal(struct inode *head, size_t blk){
+	uint32_t prev = blk > 0 ? map_get(head, blk - 1) : 0;
+	return prev != 0 ? prev + 1 : 0;
+}
+
+/* brief: make sure blocks [blk, blk + n) all have a chunk */
+int map_alloc(struct inode *head, size_t blk, size_t n){
+	for (;n > 0;n--, blk++){
+		uint32_t *slot = map_slot(head, blk, 1);
+		if (slot == NULL) return -ENOSPC;
+		if (*slot != 0) continue;
+		size_t got, run = 1, i;
+		while (run < n && map_get(head, blk + run) == 0) run++;
+		long c = alloc_chunks(map_goal(head, blk), run, &got);
+		if (c < 0) return -ENOSPC;
+		*slot = c;
+		journal_map(head, slot);
+		for (i = 1;i < got;i++){
+			slot = map_slot(head, blk + i, 1);
+			if (slot == NULL){
+				while (i < got) putChunk(c + i++);
+				return -ENOSPC;
+			}
+			*slot = c + i;
+			journal_map(head, slot);
+		}
+		blk += got - 1;
+		n -= got - 1;
+	}
+	return 0;
+}
+
+void map_free(struct inode *head){
+	size_t i, j;
+	uint32_t *node, *sub;
+	struct free_run run = {0, 0};
+	if (head -> inlined){
+		memset(&head -> map, 0, sizeof(head -> map));
+		return;
+	}
+	for (i = 0;i < NDIRECT;i++)
+		if (head -> map.direct[i]) data_drop(&run, head -> map.direct[i]);
+	if (head -> map.ind){
+		node = (uint32_t *)chunk_addr(head -> map.ind);
+		for (i = 0;i < SLOT_PER_CHUNK;i++)
+			if (node[i]) data_drop(&run, node[i]);
+		journal_revoke(head -> map.ind);
+		free_run_add(&run, head -> map.ind);
+	}
+	if (head -> map.dind){
+		node = (uint32_t *)chunk_addr(head -> map.dind);
+		for (i = 0;i < SLOT_PER_CHUNK;i++){
+			if (node[i] == 0) continue;
+			sub = (uint32_t *)chunk_addr(node[i]);
+			for (j = 0;j < SLOT_PER_CHUNK;j++)
+				if (sub[j]) data_drop(&run, sub[j]);
+			journal_revoke(node[i]);
+			free_run_add(&run, node[i]);
+		}
+		journal_revoke(head -> map.dind);
+		free_run_add(&run, head -> map.dind);
+	}
+	free_run_end(&run);
+	memset(&head -> map, 0, sizeof(head -> map));
+}
+
+/* brief: give blocks [blk, blk + n) chunks of their own before they are
+ * written, a chunk still shared (snapshot, dedup) is copied and the
+ * copy takes its slot, a packed block is decompressed into one */
+int map_own(struct inode *head, size_t blk, size_t n){
+	for (;n > 0;n--, blk++){
+		uint32_t *slot = map_slot(head, blk, 0), old;
+		size_t got;
+		if (slot == NULL || *slot == 0) continue;
+		old = *slot;
+		if (!is_packed(old) && (is_sub(old) || !dedup_shared(old))) continue;
+		uint32_t goal = map_goal(head, blk);
+		if (goal == 0 && !is_packed(old)) goal = old + 1;	/* near the chunk it copies */
+		long c = alloc_chunks(goal, 1, &got);
+		if (c < 0) return -ENOSPC;
+		if (!is_packed(old)){
+			memcpy(chunk_addr(c), chunk_addr(old), CHUNK_SIZE);
+		} else if (unpack_read(old, chunk_addr(c), CHUNK_SIZE, 0) < 0){
+			putChunk(c);
+			return -EIO;
+		}
+		*slot = c;
+		journal_map(head, slot);
+		if (is_packed(old)) pack_put(old);
+		else if (!dedup_unshare(old)) putChunk(old);
+	}
+	return 0;
+}
+
+/* brief: give block 0 of a file that is to end at end bytes the
+ * storage of its size class, a chunk past SUB_MAX; the data moves along */
+int map_fit(struct inode *head, size_t end){
+	uint32_t old = head -> map.direct[0], v;
+	int cls = sub_fit(end);
+	size_t got;
+	if (old != 0 && !is_sub(old)) return 0;
+	if (old == 0 ? cls < 0 : cls >= 0 && cls <= sub_cls(old)) return 0;
+	if (cls >= 0){
+		if ((v = sub_alloc(cls)) == 0) return -ENOSPC;
+	} else {
+		long c = alloc_chunks(0, 1, &got);
+		if (c < 0) return -ENOSPC;
+		v = c;
+	}
+	if (old != 0) memcpy(block_addr(v), block_addr(old), sub_size(sub_cls(old)));
+	head -> map.direct[0] = v;
+	if (old != 0) sub_free(old);
+	return 0;
+}
+
+/* brief: drop the blocks of [blk, end) that map chunk *up names, it
+ * covers the blocks from first on; a map chunk left empty goes too,
+ * and the caller logs *up. Slots of a chunk that goes are not logged,
+ * replay would apply them past its revoke */
+void map_punch_node(struct inode *head, uint32_t *up, size_t first, size_t blk, size_t end, struct free_run *run){
+	uint32_t *node;
+	size_t i, lo, hi;
+	if (*up == 0 || first >= end || first + SLOT_PER_CHUNK <= blk) return;
+	node = (uint32_t *)chunk_addr(*up);
+	lo = blk > first ? blk - first : 0;
+	hi = end - first < SLOT_PER_CHUNK ? end - first : SLOT_PER_CHUNK;
+	for (i = lo;i < hi;i++){
+		if (node[i] == 0) continue;
+		data_drop(run, node[i]);
+		node[i] = 0;
+	}
+	for (i = 0;i < SLOT_PER_CHUNK && node[i] == 0;i++);
+	if (i < SLOT_PER_CHUNK){
+		for (i = lo;i < hi;i++) journal_map(head, &node[i]);
+		return;
+	}
+	journal_revoke(*up);
+	free_run_add(run, *up);
+	*up = 0;
+}
+
+/* brief: turn blocks [blk, end) of head into holes, the chunks go back
+ * to the allocator (or lose an owner) */
+void map_punch(struct inode *head, size_t blk, size_t end){
+	struct free_run run = {0, 0};
+	uint32_t *node;
+	size_t i, first = NDIRECT + SLOT_PER_CHUNK;
+	for (i = blk;i < NDIRECT && i < end;i++){
+		if (head -> map.direct[i] == 0) continue;
+		data_drop(&run, head -> map.direct[i]);
+		head -> map.direct[i] = 0;
+	}
+	map_punch_node(head, &head -> map.ind, NDIRECT, blk, end, &run);
+	if (head -> map.dind != 0 && end > first){
+		node = (uint32_t *)chunk_addr(head -> map.dind);
+		for (i = blk > first ? (blk - first) / SLOT_PER_CHUNK : 0;i < SLOT_PER_CHUNK;i++)
+			map_punch_node(head, &node[i], first + i * SLOT_PER_CHUNK, blk, end, &run);
+		for (i = 0;i < SLOT_PER_CHUNK && node[i] == 0;i++);
+		if (i == SLOT_PER_CHUNK){
+			journal_revoke(head -> map.dind);
+			free_run_add(&run, head -> map.dind);
+			head -> map.dind = 0;
+		} else {
+			for (i = blk > first ? (blk - first) / SLOT_PER_CHUNK : 0;i < SLOT_PER_CHUNK;i++)
+				if (node[i] == 0) journal_map(head, &node[i]);
+		}
+	}
+	free_run_end(&run);
+}
+
+/* brief: zero bytes [off, off + len) of head, all in one block; a hole
+ * stays one, a shared or packed block gets a chunk of its own first */
+int map_zero(struct inode *head, off_t off, size_t len){
+	size_t blk = off / CHUNK_SIZE, o = off % CHUNK_SIZE;
+	uint32_t v = map_get(head, blk);
+	int err;
+	if (v == 0 || len == 0) return 0;
+	if (is_sub(v)){
+		if (o >= sub_size(sub_cls(v))) return 0;
+		if (o + len > sub_size(sub_cls(v))) len = sub_size(sub_cls(v)) - o;
+	} else if ((err = map_own(head, blk, 1)) < 0){
+		return err;
+	}
+	memset(block_addr(map_get(head, blk)) + o, 0, len);
+	return 0;
+}
+
+/* brief: let the full blocks [blk, blk + n), just written, share an
+ * identical chunk that is indexed already */
+void map_dedup(struct inode *head, size_t blk, size_t n){
+	for (;n > 0;n--, blk++){
+		uint32_t *slot = map_slot(head, blk, 0), c, x;
+		if (slot == NULL || (c = *slot) == 0 || (x = dedup_match(c)) == 0) continue;
+		*slot = x;
+		journal_map(head, slot);
+		__atomic_add_fetch(&dedup_hits, 1, __ATOMIC_RELAXED);
+		if (!dedup_unshare(c)) putChunk(c);	/* an indexed c leaves the index first */
+	}
+}
+
+/* brief: copy the block map of src into dst, whose map is empty: the
+ * data chunks are shared, only the map chunks are copied; on failure
+ * dst keeps what it got so far and map_free undoes it */
+int map_clone(struct inode *dst, struct inode *src){
+	size_t i, j;
+	uint32_t *node, *sub;
+	int c;
+	dst -> inlined = src -> inlined;
+	if (src -> inlined){
+		dst -> map = src -> map;
+		return 0;
+	}
+	for (i = 0;i < NDIRECT;i++){
+		if (src -> map.direct[i] == 0) continue;
+		if (is_sub(src -> map.direct[i])){
+			uint32_t v = sub_alloc(sub_cls(src -> map.direct[i]));
+			if (v == 0) return -ENOSPC;
+			memcpy(block_addr(v), block_addr(src -> map.direct[i]), sub_size(sub_cls(v)));
+			dst -> map.direct[i] = v;
+			continue;
+		}
+		data_share(src -> map.direct[i]);
+		dst -> map.direct[i] = src -> map.direct[i];
+	}
+	if (src -> map.ind){
+		if ((c = getFreeChunk()) < 0) return -ENOSPC;
+		node = (uint32_t *)chunk_addr(src -> map.ind);
+		memcpy(chunk_addr(c), node, CHUNK_SIZE);
+		for (i = 0;i < SLOT_PER_CHUNK;i++)
+			if (node[i]) data_share(node[i]);
+		dst -> map.ind = c;
+	}
+	if (src -> map.dind){
+		if ((c = getFreeChunk()) < 0) return -ENOSPC;
+		memset(chunk_addr(c), 0, CHUNK_SIZE);
+		dst -> map.dind = c;
+		node = (uint32_t *)chunk_addr(src -> map.dind);
+		for (i = 0;i < SLOT_PER_CHUNK;i++){
+			if (node[i] == 0) continue;
+			if ((c = getFreeChunk()) < 0) return -ENOSPC;
+			sub = (uint32_t *)chunk_addr(node[i]);
+			memcpy(chunk_addr(c), sub, CHUNK_SIZE);
+			for (j = 0;j < SLOT_PER_CHUNK;j++)
+				if (sub[j]) data_share(sub[j]);
+			((uint32_t *)chunk_addr(dst -> map.dind))[i] = c;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Journal (with --image)
+ *
+ * Metadata changes are also logged to <image>.journal as redo records:
+ * the new contents of inode slots, slot writes into block map chunks,
+ * zeroed map chunks, and revokes for map and name chunks that were
+ * freed (what they hold later is data that an older record must not be
+ * replayed over). A thread collects the records of one operation in its
+ * own buffer and hands them over whole while it still holds the
+ * operation's locks, so the log order is the order the changes were
+ * made in. One thread writes whatever is pending as a group and
+ * fdatasyncs it; operations that arrive while a group is being synced
+ * share the next one. Namespace operations and fsync wait for their
+ * group before they reply, plain writes do not. A group that fails to
+ * reach the disk stops the journal: nothing after it is written (replay
+ * would apply it without what came before) and every wait returns EIO.
+ * Groups carry a sequence number and a checksum. Once the journal grows
+ * past JOURNAL_MAX the image is synced, its superblock records the last
+ * group it contains, and the journal starts over at offset 0. A mount
+ * replays the groups that follow, so recovery reads at most
+ * JOURNAL_MAX bytes plus one group.
+ */
+#define JOURNAL_MAGIC 0x4a4c4548	/* "HELJ" */
+#define JOURNAL_MAX (16 * 1024 * 1024)
+
+enum journal_type{
+	J_SLOT = 1,	/* target ino, payload the slot (and a long name) */
+	J_MAP,		/* target chunk, uint32_t value at index */
+	J_ZERO,		/* target chunk cleared */
+	J_REVOKE,	/* target chunk freed, earlier records on it are void */
+};
+
+struct journal_group{
+	uint32_t magic;
+	uint32_t len;		/* bytes of records that follow */
+	uint64_t seq;
+	uint64_t sum;		/* FNV-1a of the records */
+};
+
+struct journal_rec{
+	uint16_t type;
+	uint16_t len;		/* payload bytes that follow */
+	uint32_t target;
+	uint32_t index;
+	uint32_t value;
+};
+
+/* brief: records of the operation a thread is in the middle of */
+struct journal_txn{
+	char *buf;
+	size_t len, cap;
+	int depth;		/* nested journal_begin calls */
+	uint64_t lsn;		/* end of the thread's last handed over txn */
+	int data;		/* names image data written outside the journal */
+};
+
+int journal_fd = -1;
+__thread struct journal_txn journal_txn;
+pthread_key_t journal_key;
+/* pending records; spare is the buffer the writer is busy with */
+char *journal_buf, *journal_spare;
+size_t journal_len, journal_cap, journal_spare_cap;
+uint64_t journal_lsn;		/* bytes handed over so far */
+uint64_t journal_durable;	/* of those, bytes on disk */
+int journal_error;		/* -EIO once a group or checkpoint failed */
+int journal_data;		/* pending group must sync the image first */
+uint64_t journal_seq;		/* last group written */
+uint64_t journal_commits, journal_txns;
+off_t journal_off;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER;
+pthread_t journal_thread;
+int journal_running, journal_stop;
+
+uint64_t journal_sum(const char *p, size_t n){
+	uint64_t h = 14695981039346656037ULL;
+	while (n-- > 0){
+		h ^= (unsigned char)*p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int journal_grow(char **buf, size_t *cap, size_t need){
+	if (need <= *cap) return 0;
+	size_t cap2 = *cap ? *cap : 4096;
+	while (cap2 < need) cap2 *= 2;
+	char *p = realloc(*buf, cap2);
+	if (p == NULL) return -1;
+	*buf = p;
+	*cap = cap2;
+	return 0;
+}
+
+/* brief: move n bytes of records into the pending group, caller holds
+ * journal_lock; a record that cannot be queued is lost, noisily */
+void journal_queue(const char *p, size_t n){
+	if (journal_grow(&journal_buf, &journal_cap, journal_len + n) < 0){
+		fprintf(stderr, "journal: out of memory, %zu bytes of records lost\n", n);
+		return;
+	}
+	memcpy(journal_buf + journal_len, p, n);
+	journal_len += n;
+	journal_lsn += n;
+	pthread_cond_signal(&journal_work);
+}
+
+void journal_txn_free(void *arg){
+	struct journal_txn *t = arg;
+	free(t -> buf);
+	t -> buf = NULL;
+	t -> cap = 0;
+}
+
+void journal_put(void){
+	struct journal_txn *t = &journal_txn;
+	int data = t -> data;
+	t -> data = 0;
+	if (t -> len == 0) return;
+	pthread_mutex_lock(&journal_lock);
+	journal_queue(t -> buf, t -> len);
+	journal_data |= data;
+	journal_txns++;
+	t -> lsn = journal_lsn;
+	pthread_mutex_unlock(&journal_lock);
+	t -> len = 0;
+}
+
+void journal_begin(void){
+	if (journal_fd >= 0) journal_txn.depth++;
+}
+
+void journal_end(void){
+	if (journal_fd < 0 || --journal_txn.depth > 0) return;
+	journal_put();
+}
+
+/* brief: add a record to the thread's txn, one outside any txn goes
+ * out on its own */
+void journal_add(int type, uint32_t target, uint32_t index, uint32_t value, const void *p, size_t n){
+	struct journal_txn *t = &journal_txn;
+	struct journal_rec r = {type, n, target, index, value};
+	if (journal_fd < 0) return;
+	if (t -> buf == NULL) pthread_setspecific(journal_key, t);
+	if (journal_grow(&t -> buf, &t -> cap, t -> len + sizeof(r) + n) < 0){
+		fprintf(stderr, "journal: out of memory, record lost\n");
+		return;
+	}
+	memcpy(t -> buf + t -> len, &r, sizeof(r));
+	memcpy(t -> buf + t -> len + sizeof(r), p, n);
+	t -> len += sizeof(r) + n;
+	if (t -> depth == 0) journal_put();
+}
+
+void journal_slot(fuse_ino_t ino, const char *long_name){
+	char rec[sizeof(struct dinode) + FILE_NAME_LEN];
+	size_t n = sizeof(struct dinode);
+	memcpy(rec, &image_inodes[ino], n);
+	if (long_name != NULL){
+		strcpy(rec + n, long_name);
+		n += strlen(long_name) + 1;
+	}
+	journal_add(J_SLOT, ino, 0, 0, rec, n);
+}
+
+/* brief: log a block map slot just set, the ones inside the inode are
+ * part of its J_SLOT record */
+void journal_map(struct inode *head, uint32_t *slot){
+	if (journal_fd < 0 || ((char *)slot >= (char *)&head -> map && (char *)slot < (char *)(&head -> map + 1))) return;
+	uint32_t c = ((char *)slot - bank_base) / CHUNK_SIZE;
+	journal_add(J_MAP, c, slot - (uint32_t *)chunk_addr(c), *slot, NULL, 0);
+}
+
+void journal_zero(uint32_t c){
+	journal_add(J_ZERO, c, 0, 0, NULL, 0);
+}
+
+/* brief: queued at once, ahead of the free, so no record of the chunk's
+ * next owner can come before it */
+void journal_revoke(uint32_t c){
+	struct journal_rec r = {J_REVOKE, 0, c, 0, 0};
+	if (journal_fd < 0) return;
+	pthread_mutex_lock(&journal_lock);
+	journal_queue((char *)&r, sizeof(r));
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* brief: wait until the thread's last txn is on disk, -EIO if it
+ * never gets there */
+int journal_sync(void){
+	uint64_t lsn = journal_txn.lsn;
+	int res;
+	if (journal_fd < 0 || lsn == 0) return 0;
+	pthread_mutex_lock(&journal_lock);
+	while (journal_durable < lsn && journal_running && journal_error == 0)
+		pthread_cond_wait(&journal_done, &journal_lock);
+	res = journal_durable < lsn ? journal_error : 0;
+	pthread_mutex_unlock(&journal_lock);
+	return res;
+}
+
+/* brief: make the image contain every group written so far, then let
+ * the journal start over; if the image cannot be synced the journal
+ * keeps growing and the next group tries again */
+int journal_checkpoint(void){
+	if (fsync(image_fd) < 0){
+		perror("journal checkpoint");
+		return -EIO;
+	}
+	image_sb -> checkpoint_seq = journal_seq;
+	if (msync(image_sb, sizeof(struct image_super), MS_SYNC) < 0){
+		perror("journal checkpoint");
+		return -EIO;
+	}
+	journal_off = 0;
+	return 0;
+}
+
+/* brief: write and sync one group, data says some of its records name
+ * image blocks that must be on disk before them */
+int journal_write(char *buf, size_t len, int data){
+	struct journal_group g = {JOURNAL_MAGIC, len, journal_seq + 1, journal_sum(buf, len)};
+	struct iovec iov[2] = {{&g, sizeof(g)}, {buf, len}};
+	ssize_t res = 0;
+	if ((data && fdatasync(image_fd) < 0)
+	    || (res = pwritev(journal_fd, iov, 2, journal_off)) != (ssize_t)(sizeof(g) + len)
+	    || fdatasync(journal_fd) < 0){
+		perror("journal write");
+		TRACE_EVENT(TR_COMMIT, journal_seq + 1, journal_off, len, -EIO);
+		return -EIO;
+	}
+	journal_seq++;
+	journal_off += res;
+	TRACE_EVENT(TR_COMMIT, journal_seq, journal_off, len, 0);
+	if (journal_off >= JOURNAL_MAX) journal_checkpoint();
+	return 0;
+}
+
+void *journal_main(void *arg){
+	pthread_mutex_lock(&journal_lock);
+	for (;;){
+		while (journal_len == 0 && !journal_stop)
+			pthread_cond_wait(&journal_work, &journal_lock);
+		if (journal_len == 0) break;
+		char *buf = journal_buf;
+		size_t len = journal_len, cap = journal_cap;
+		uint64_t lsn = journal_lsn;
+		int data = journal_data;
+		journal_data = 0;
+		journal_buf = journal_spare;
+		journal_cap = journal_spare_cap;
+		journal_len = 0;
+		int err = journal_error;
+		pthread_mutex_unlock(&journal_lock);
+		if (err == 0) err = journal_write(buf, len, data);
+		pthread_mutex_lock(&journal_lock);
+		journal_spare = buf;
+		journal_spare_cap = cap;
+		if (err == 0){
+			journal_durable = lsn;
+			journal_commits++;
+		} else {
+			journal_error = err;
+		}
+		pthread_cond_broadcast(&journal_done);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+/* brief: replay the groups written after the last checkpoint onto the
+ * inode table and map chunks, returns the number of groups replayed
+ * a first pass finds the revokes: a record on a chunk that is revoked
+ * further on is skipped, the chunk may hold data by now */
+int journal_recover(void){
+	struct stat st;
+	char *log;
+	uint64_t *revoked, pos;
+	size_t off, end = 0;
+	int pass, groups = 0;
+	journal_seq = image_sb -> checkpoint_seq;
+	if (fstat(journal_fd, &st) < 0 || st.st_size == 0) return 0;
+	log = malloc(st.st_size);
+	revoked = calloc(CHUNK_NUM, sizeof(uint64_t));
+	if (log == NULL || revoked == NULL || pread(journal_fd, log, st.st_size, 0) != st.st_size){
+		fprintf(stderr, "journal: cannot read it back, not replayed\n");
+		free(log);
+		free(revoked);
+		return 0;
+	}
+	/* the valid groups are the ones in sequence from offset 0 */
+	for (off = 0;off + sizeof(struct journal_group) <= (size_t)st.st_size;groups++){
+		struct journal_group g;
+		memcpy(&g, log + off, sizeof(g));
+		if (g.magic != JOURNAL_MAGIC || g.seq != journal_seq + groups + 1 ||
+		    g.len > st.st_size - off - sizeof(g) || journal_sum(log + off + sizeof(g), g.len) != g.sum)
+			break;
+		off += sizeof(g) + g.len;
+	}
+	end = off;
+	for (pass = 0;pass < 2;pass++){
+		for (off = 0, pos = 1;off < end;){
+			struct journal_group g;
+			size_t r;
+			memcpy(&g, log + off, sizeof(g));
+			for (r = off + sizeof(g);r + sizeof(struct journal_rec) <= off + sizeof(g) + g.len;pos++){
+				struct journal_rec rec;
+				char *payload = log + r + sizeof(rec);
+				memcpy(&rec, log + r, sizeof(rec));
+				r += sizeof(rec) + rec.len;
+				if (rec.type == J_SLOT){
+					if (pass == 0 || rec.target >= IMAGE_SLOTS || rec.len < sizeof(struct dinode)) continue;
+					struct dinode *d = &image_inodes[rec.target];
+					memcpy(d, payload, sizeof(struct dinode));
+					if (d -> parent != 0 && rec.target >= image_sb -> ino_next) image_sb -> ino_next = rec.target + 1;
+					if (rec.len > sizeof(struct dinode) && d -> name_chunk != 0 && d -> name_chunk < CHUNK_NUM &&
+					    revoked[d -> name_chunk] < pos && rec.len - sizeof(struct dinode) <= CHUNK_SIZE){
+						bank_map(d -> name_chunk / CHUNK_PER_BANK);
+						memcpy(chunk_addr(d -> name_chunk), payload + sizeof(struct dinode), rec.len - sizeof(struct dinode));
+					}
+					continue;
+				}
+				if (rec.target == 0 || rec.target >= CHUNK_NUM) continue;
+				if (pass == 0){
+					if (rec.type == J_REVOKE) revoked[rec.target] = pos;
+					continue;
+				}
+				if (revoked[rec.target] > pos) continue;
+				if (rec.type == J_ZERO || (rec.type == J_MAP && rec.index < SLOT_PER_CHUNK))
+					bank_map(rec.target / CHUNK_PER_BANK);
+				if (rec.type == J_ZERO)
+					memset(chunk_addr(rec.target), 0, CHUNK_SIZE);
+				else if (rec.type == J_MAP && rec.index < SLOT_PER_CHUNK)
+					((uint32_t *)chunk_addr(rec.target))[rec.index] = rec.value;
+			}
+			off += sizeof(g) + g.len;
+		}
+	}
+	journal_seq += groups;
+	free(log);
+	free(revoked);
+	return groups;
+}
+
+void journal_start(void){
+	journal_stop = 0;
+	journal_off = 0;
+	if (pthread_create(&journal_thread, NULL, journal_main, NULL) == 0)
+		journal_running = 1;
+	else
+		journal_fd = -1;	/* nothing to write it: no journal */
+}
+
+/* brief: write out what is pending and stop the writer */
+void journal_end_all(void){
+	if (!journal_running) return;
+	pthread_mutex_lock(&journal_lock);
+	journal_stop = 1;
+	pthread_cond_signal(&journal_work);
+	pthread_mutex_unlock(&journal_lock);
+	pthread_join(journal_thread, NULL);
+	journal_running = 0;
+}
+
+/* brief: open or create the image, done before the daemon detaches so
+ * a relative path and errors still reach the terminal */
+int image_open(const char *path){
+	struct image_super *sb;
+	struct stat st;
+	char *meta, jpath[4096];
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0){
+		perror(path);
+		return -1;
+	}
+	if ((uint64_t)st.st_size < IMAGE_SIZE && ftruncate(fd, IMAGE_SIZE) < 0){
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	meta = mmap(NULL, IMAGE_SIZE - IMAGE_SUPER, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, IMAGE_SUPER);
+	if (meta == MAP_FAILED){
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	sb = (struct image_super *)meta;
+	if (st.st_size == 0){
+		memcpy(sb -> magic, IMAGE_MAGIC, sizeof(sb -> magic));
+		sb -> version = IMAGE_VERSION;
+		sb -> chunk_size = CHUNK_SIZE;
+		sb -> total_size = TOTAL_SIZE;
+		sb -> ino_slots = IMAGE_SLOTS;
+		sb -> dinode_size = sizeof(struct dinode);
+		sb -> clean = 1;
+	} else if (memcmp(sb -> magic, IMAGE_MAGIC, sizeof(sb -> magic)) != 0 || sb -> version != IMAGE_VERSION ||
+		   sb -> chunk_size != CHUNK_SIZE || sb -> total_size != TOTAL_SIZE ||
+		   sb -> ino_slots != IMAGE_SLOTS || sb -> dinode_size != sizeof(struct dinode)){
+		fprintf(stderr, "%s: not an image of this build\n", path);
+		munmap(meta, IMAGE_SIZE - IMAGE_SUPER);
+		close(fd);
+		return -1;
+	} else if (sb -> ino_next > IMAGE_SLOTS){
+		fprintf(stderr, "%s: corrupt superblock, %llu inodes in a table of %llu\n", path,
+			(unsigned long long)sb -> ino_next, (unsigned long long)IMAGE_SLOTS);
+		munmap(meta, IMAGE_SIZE - IMAGE_SUPER);
+		close(fd);
+		return -1;
+	}
+	snprintf(jpath, sizeof(jpath), "%s.journal", path);
+	journal_fd = open(jpath, O_RDWR | O_CREAT, 0600);
+	if (journal_fd < 0){
+		perror(jpath);
+		munmap(meta, IMAGE_SIZE - IMAGE_SUPER);
+		close(fd);
+		return -1;
+	}
+	image_fd = fd;
+	image_sb = sb;
+	chunk_bits = (uint64_t *)(meta + (IMAGE_BITMAP - IMAGE_SUPER));
+	return 0;
+}
+
+/* brief: chunk for a name too long for a slot, 0 when none is needed */
+long image_name_alloc(const char *name){
+	if (image_inodes == NULL || strlen(name) < DINODE_NAME) return 0;
+	int c = getFreeChunk();
+	return c < 0 ? -ENOSPC : c;
+}
+
+/* brief: write the name and the parent of head to its slot, the parent
+ * goes last as it marks the slot in use; caller holds the parent's lock
+ * name_chunk comes from image_name_alloc for the current name */
+void image_name(struct inode *head, long name_chunk){
+	if (image_inodes == NULL) return;
+	struct dinode *d = &image_inodes[head -> ino];
+	uint32_t old = d -> name_chunk;
+	size_t len = name_len(head -> filename);
+	d -> generation = head -> generation;
+	d -> isDirectories = head -> isDirectories;
+	d -> readonly = head -> readonly;
+	d -> namelen = len;
+	memcpy(name_chunk ? chunk_addr(name_chunk) : d -> name, head -> filename, len + 1);
+	d -> name_chunk = name_chunk;
+	d -> parent = head -> father -> ino;
+	journal_slot(head -> ino, name_chunk ? head -> filename : NULL);
+	if (old != 0 && old != name_chunk){
+		journal_revoke(old);
+		putChunk(old);
+	}
+}
+
+/* brief: write size, mtime and block map of head to its slot, caller
+ * holds head's write lock (or its parent's while head is created) */
+void image_data(struct inode *head){
+	if (image_inodes == NULL || head == root) return;
+	struct dinode *d = &image_inodes[head -> ino];
+	d -> size = head -> size;
+	d -> mtime = head -> timeLastModified;
+	d -> map = head -> map;
+	d -> inlined = head -> inlined;
+	journal_slot(head -> ino, NULL);
+}
+
+/* brief: free head's slot, it just left the namespace; its chunks stay
+ * marked until the inode itself goes */
+void image_clear(struct inode *head){
+	if (image_inodes == NULL) return;
+	struct dinode *d = &image_inodes[head -> ino];
+	d -> parent = 0;
+	if (d -> name_chunk != 0){
+		journal_revoke(d -> name_chunk);
+		putChunk(d -> name_chunk);
+		d -> name_chunk = 0;
+	}
+	journal_slot(head -> ino, NULL);
+}
+
+int image_chunk_ok(uint32_t c){
+	if (c == 0 || c >= CHUNK_NUM) return 0;
+	bank_map(c / CHUNK_PER_BANK);
+	return 1;
+}
+
+/* brief: count one more owner of data chunk c, seen has the chunks
+ * some file owns already; a packed block counts for its pack, a
+ * sub-block takes its place in its class chunk */
+void image_own(uint32_t c, uint64_t *seen){
+	if (is_sub(c)){
+		if (sub_cls(c) >= SUB_CLASSES || !image_chunk_ok(sub_chunk(c))) return;
+		chunk_mark(sub_chunk(c), 1);
+		if (sub_used[sub_chunk(c)] == 0) sub_list(&sub_class[sub_cls(c)], sub_chunk(c));
+		sub_used[sub_chunk(c)] |= 1u << (c & 31);
+		sub_class[sub_cls(c)].nblocks++;
+		return;
+	}
+	if (is_packed(c)){
+		if (!image_chunk_ok(pack_chunk(c))) return;
+		chunk_mark(pack_chunk(c), 1);
+		if (pack_refs[pack_chunk(c)]++ == 0) pack_chunks++;
+		return;
+	}
+	if (!image_chunk_ok(c)) return;
+	chunk_mark(c, 1);
+	if (seen[c >> 6] >> (c & 63) & 1) chunk_share_add(c);
+	seen[c >> 6] |= 1ULL << (c & 63);
+}
+
+/* brief: mark every chunk the block map of head uses, map_free's walk */
+void image_mark_map(struct inode *head, uint64_t *seen){
+	size_t i, j;
+	uint32_t *node, *sub;
+	if (head -> inlined) return;
+	for (i = 0;i < NDIRECT;i++)
+		image_own(head -> map.direct[i], seen);
+	if (image_chunk_ok(head -> map.ind)){
+		node = (uint32_t *)chunk_addr(head -> map.ind);
+		for (i = 0;i < SLOT_PER_CHUNK;i++)
+			image_own(node[i], seen);
+		chunk_mark(head -> map.ind, 1);
+	}
+	if (image_chunk_ok(head -> map.dind)){
+		node = (uint32_t *)chunk_addr(head -> map.dind);
+		for (i = 0;i < SLOT_PER_CHUNK;i++){
+			if (!image_chunk_ok(node[i])) continue;
+			sub = (uint32_t *)chunk_addr(node[i]);
+			for (j = 0;j < SLOT_PER_CHUNK;j++)
+				image_own(sub[j], seen);
+			chunk_mark(node[i], 1);
+		}
+		chunk_mark(head -> map.dind, 1);
+	}
+}
+
+/* brief: in-memory inode for slot ino, NULL if the slot is damaged */
+struct inode *image_inode(fuse_ino_t ino){
+	struct dinode *d = &image_inodes[ino];
+	struct inode *now;
+	const char *name = d -> name;
+	if (d -> namelen == 0 || d -> namelen >= FILE_NAME_LEN - 1) return NULL;
+	if (d -> name_chunk != 0){
+		if (!image_chunk_ok(d -> name_chunk)) return NULL;
+		name = chunk_addr(d -> name_chunk);
+	} else if (d -> namelen >= DINODE_NAME){
+		return NULL;
+	}
+	if (memchr(name, 0, d -> namelen) != NULL || name[d -> namelen] != 0) return NULL;
+	if ((now = slab_alloc(&inode_slab)) == NULL) return NULL;
+	if ((now -> filename = name_get(name, d -> namelen)) == NULL){
+		slab_free(&inode_slab, now);
+		return NULL;
+	}
+	now -> ino = ino;
+	now -> generation = d -> generation;
+	now -> size = d -> size;
+	now -> timeLastModified = d -> mtime;
+	now -> isDirectories = d -> isDirectories == 1;
+	now -> readonly = d -> readonly == 1;
+	now -> inlined = d -> inlined == 1 && now -> isDirectories != 1;
+	if (now -> inlined && now -> size > INLINE_MAX) now -> size = INLINE_MAX;	/* its bytes are no chunk numbers */
+	now -> map = d -> map;
+	now -> refcnt = 1;
+	pthread_rwlock_init(&now -> lock, NULL);
+	if (ino_pages[ino / INO_PAGE] == NULL)
+		ino_pages[ino / INO_PAGE] = calloc(INO_PAGE, sizeof(struct inode *));
+	ino_pages[ino / INO_PAGE][ino % INO_PAGE] = now;
+	return now;
+}
+
+/* brief: rebuild the tree from the inode table at mount, before any
+ * request; entries reachable from the root are linked in slot order, the
+ * rest (cut off by a crash) is dropped. Only metadata is read, the data
+ * stays where it is. The allocator counters follow from the bitmap */
+void image_load(void){
+	size_t start = ino_next, n;
+	uint32_t *first, *next;
+	struct inode **queue;
+	size_t qh = 0, qt = 0;
+	uint32_t c;
+	uint64_t *old_bits = NULL, *seen;
+	int rebuild = !image_sb -> clean;
+	size_t ino, b, w;
+	struct inode *dir, *now;
+
+	image_inodes = (struct dinode *)((char *)image_sb + (IMAGE_INODES - IMAGE_SUPER));
+	if (journal_recover() > 0) rebuild = 1;
+	n = image_sb -> ino_next > start ? image_sb -> ino_next : start;
+	if (n > IMAGE_SLOTS) n = IMAGE_SLOTS;	/* image_open refused more, replay stays within it */
+	first = calloc(n, sizeof(uint32_t));
+	next = calloc(n, sizeof(uint32_t));
+	queue = malloc(n * sizeof(struct inode *));
+	if (first == NULL || next == NULL || queue == NULL){
+		perror("image load");
+		exit(1);
+	}
+	for (ino = n;ino-- > start;){
+		struct dinode *d = &image_inodes[ino];
+		if (d -> parent == 0 || d -> parent >= n) continue;
+		next[ino] = first[d -> parent];
+		first[d -> parent] = ino;
+	}
+	queue[qt++] = root;
+	queue[qt++] = snap_inode;
+	while (qh < qt){
+		dir = queue[qh++];
+		for (ino = first[dir -> ino];ino != 0;ino = next[ino]){
+			if ((now = image_inode(ino)) == NULL) continue;
+			if (dir_lookup(dir, now -> filename, name_len(now -> filename)) != NULL){
+				ino_pages[ino / INO_PAGE][ino % INO_PAGE] = NULL;
+				pthread_rwlock_destroy(&now -> lock);
+				name_put(now -> filename);
+				slab_free(&inode_slab, now);
+				continue;
+			}
+			dir_insert(dir, now);
+			if (now -> isDirectories == 1) queue[qt++] = now;
+			if (now -> generation > ino_generation) ino_generation = now -> generation;
+		}
+	}
+	for (ino = start;ino < n;ino++){
+		if (ino_pages[ino / INO_PAGE] != NULL && ino_pages[ino / INO_PAGE][ino % INO_PAGE] != NULL) continue;
+		if (image_inodes[ino].parent != 0){
+			image_inodes[ino].parent = 0;	/* orphan, its chunks go with the rebuild */
+			rebuild = 1;
+		}
+		image_inodes[ino].name_chunk = 0;	/* a crash in image_clear leaves it behind */
+		if (ino_nfree == ino_free_cap){
+			ino_free_cap = ino_free_cap ? ino_free_cap * 2 : 1024;
+			if ((ino_free = realloc(ino_free, ino_free_cap * sizeof(fuse_ino_t))) == NULL){
+				perror("image load");
+				exit(1);
+			}
+		}
+		ino_free[ino_nfree++] = ino;
+	}
+	__atomic_store_n(&ino_next, n, __ATOMIC_RELEASE);
+
+	/* snapshots and --dedup share chunks, their owners are counted on
+	 * every mount; the walk marks the bitmap anew when it is rebuilt */
+	seen = calloc(CHUNK_NUM / 64, sizeof(uint64_t));
+	if (seen == NULL || (rebuild && (old_bits = malloc(CHUNK_NUM / 8)) == NULL)){
+		perror("image load");
+		exit(1);
+	}
+	if (rebuild){
+		memcpy(old_bits, chunk_bits, CHUNK_NUM / 8);
+		memset(chunk_bits, 0, CHUNK_NUM / 8);
+		chunk_mark(0, 1);
+	}
+	for (ino = start;ino < n;ino++){
+		if ((now = ino_lookup(ino)) == NULL) continue;
+		image_mark_map(now, seen);
+		if (image_inodes[ino].name_chunk != 0) chunk_mark(image_inodes[ino].name_chunk, 1);
+	}
+	free(seen);
+	/* write times are not kept, nothing counts as cold for the first
+	 * --compress interval after a mount */
+	uint32_t mount_time = time(NULL);
+	for (c = 0;c < CHUNK_NUM;c++)
+		chunk_wtime[c] = mount_time;
+	/* full class chunks leave the lists image_own put them on */
+	for (b = 0;b < SUB_CLASSES;b++)
+		for (w = sub_class[b].npartial;w > 0;w--)
+			if (sub_used[sub_class[b].partial[w - 1]] == sub_full(b))
+				sub_unlist(&sub_class[b], sub_class[b].partial[w - 1]);
+	if (rebuild){
+		/* chunks nobody owns any more must read as zeros again */
+		for (c = 1;c < CHUNK_NUM;c++)
+			if ((old_bits[c >> 6] >> (c & 63) & 1) && !(chunk_bits[c >> 6] >> (c & 63) & 1)){
+				bank_map(c / CHUNK_PER_BANK);
+				if (madvise(chunk_addr(c), CHUNK_SIZE, MADV_REMOVE) < 0)
+					memset(chunk_addr(c), 0, CHUNK_SIZE);
+			}
+		free(old_bits);
+	}
+	memset(chunk_full, 0, sizeof(chunk_full));
+	chunk_free = CHUNK_NUM - 1;
+	for (b = 0;b < BANK_NUM;b++){
+		size_t used = 0;
+		for (w = b * CHUNK_PER_BANK / 64;w < (b + 1) * CHUNK_PER_BANK / 64;w++){
+			used += __builtin_popcountll(chunk_bits[w]);
+			if (chunk_bits[w] == ~0ULL) chunk_full[w >> 6] |= 1ULL << (w & 63);
+		}
+		if (b == 0) used--;	/* chunk 0 */
+		bank_used[b] = used;
+		chunk_free -= used;
+		if (used > 0) bank_map(b);
+	}
+	/* what was replayed is in the image now, the journal starts over */
+	fsync(image_fd);
+	image_sb -> checkpoint_seq = journal_seq;
+	image_sb -> clean = 0;
+	msync(image_sb, sizeof(struct image_super), MS_SYNC);
+	journal_start();
+	free(first);
+	free(next);
+	free(queue);
+}
+
+/* brief: clean unmount, after the last request: this thread's cached
+ * chunks go back (worker threads dropped theirs as they exited), then
+ * everything is flushed and the bitmap declared exact */
+void image_close(void){
+	if (image_sb == NULL) return;
+	chunk_cache_drop(&chunk_cache);
+	journal_end_all();
+	if (fsync(image_fd) < 0){
+		perror("image close");	/* left unclean, the next mount replays */
+		return;
+	}
+	image_sb -> checkpoint_seq = journal_seq;
+	image_sb -> clean = 1;
+	msync(image_sb, sizeof(struct image_super), MS_SYNC);
+}
+
+/* brief: kernel cache invalidations (--cache)
+ * the kernel only sees changes made through it, whatever the engine
+ * changes on its own is reported here; sending is left to a thread of
+ * its own since a notification may wait on a request for the same
+ * inode that is still being served */
+struct inval{
+	struct inval *next;
+	fuse_ino_t parent;	/* entry invalidation when set, else inode */
+	fuse_ino_t ino;
+	char name[];		/* entry name, or the path on the high-level API */
+};
+struct fuse_session *inval_se;	/* set when serving the low-level API */
+struct fuse *inval_fuse;
+struct inval *inval_head, **inval_tail = &inval_head;
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+pthread_t inval_thread;
+int inval_running, inval_stop;
+
+void *inval_main(void *arg){
+	struct inval *q;
+	pthread_mutex_lock(&inval_lock);
+	for (;;){
+		while (inval_head == NULL && !inval_stop)
+			pthread_cond_wait(&inval_cond, &inval_lock);
+		if (inval_head == NULL) break;
+		q = inval_head;
+		inval_head = q -> next;
+		if (inval_head == NULL) inval_tail = &inval_head;
+		pthread_mutex_unlock(&inval_lock);
+		if (inval_se != NULL && q -> parent != 0)
+			fuse_lowlevel_notify_inval_entry(inval_se, q -> parent, q -> name, strlen(q -> name));
+		else if (inval_se != NULL)
+			fuse_lowlevel_notify_inval_inode(inval_se, q -> ino, 0, 0);
+		else
+			fuse_invalidate_path(inval_fuse, q -> name);
+		free(q);
+		pthread_mutex_lock(&inval_lock);
+	}
+	pthread_mutex_unlock(&inval_lock);
+	return NULL;
+}
+
+void inval_push(fuse_ino_t parent, fuse_ino_t ino, const char *name){
+	struct inval *q;
+	if (!inval_running) return;
+	q = malloc(sizeof(struct inval) + strlen(name) + 1);
+	if (q == NULL) return;
+	q -> next = NULL;
+	q -> parent = parent;
+	q -> ino = ino;
+	strcpy(q -> name, name);
+	pthread_mutex_lock(&inval_lock);
+	*inval_tail = q;
+	inval_tail = &q -> next;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
+}
+
+/* brief: absolute path of head, -1 once it left the namespace or when
+ * the path does not fit in size bytes */
+int inode_path(struct inode *head, char *buf, size_t size){
+	size_t pos = size - 1, len;
+	int res = 0;
+	buf[pos] = 0;
+	pthread_mutex_lock(&rename_lock);
+	for (;head != root;head = __atomic_load_n(&head -> father, __ATOMIC_ACQUIRE)){
+		len = head == NULL ? size : name_len(head -> filename);
+		if (len + 1 > pos){
+			res = -1;
+			break;
+		}
+		pos -= len;
+		memcpy(buf + pos, head -> filename, len);
+		buf[--pos] = '/';
+	}
+	pthread_mutex_unlock(&rename_lock);
+	if (res == 0 && pos == size - 1) buf[--pos] = '/';
+	memmove(buf, buf + pos, size - pos);
+	return res;
+}
+
+/* brief: drop the kernel's cached attributes and pages of head; the
+ * caller holds no inode lock, the path walk takes rename_lock */
+void inval_inode(struct inode *head){
+	char path[4096];
+	if (!inval_running) return;
+	if (inval_se != NULL) inval_push(0, head -> ino, "");
+	else if (inode_path(head, path, sizeof(path)) == 0) inval_push(0, head -> ino, path);
+}
+
+/* brief: drop the kernel's dentry for name in dir, and what it caches
+ * under it (the high-level API goes by the path); no inode lock held,
+ * as for inval_inode. Once dir itself is unlinked there is no path, the
+ * invalidation of dir's own entry covers it there */
+void inval_entry(struct inode *dir, const char *name){
+	char path[4096];
+	size_t len;
+	if (!inval_running) return;
+	if (inval_se != NULL){
+		inval_push(dir -> ino, 0, name);
+	} else if (inode_path(dir, path, sizeof(path)) == 0 && (len = strlen(path)) + strlen(name) + 2 <= sizeof(path)){
+		snprintf(path + len, sizeof(path) - len, "%s%s", len > 1 ? "/" : "", name);
+		inval_push(0, 0, path);
+	}
+}
+
+void inval_start(struct fuse_session *se, struct fuse *f){
+	inval_se = se;
+	inval_fuse = f;
+	inval_stop = 0;
+	if (pthread_create(&inval_thread, NULL, inval_main, NULL) == 0)
+		inval_running = 1;
+}
+
+/* brief: send what is queued and stop the notifier */
+void inval_end(void){
+	if (!inval_running) return;
+	pthread_mutex_lock(&inval_lock);
+	inval_stop = 1;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
+	pthread_join(inval_thread, NULL);
+	inval_running = 0;
+}
+
+/* brief: engine setup shared by both front-ends */
+struct inode *MakeNode(struct inode *father, const char *filename, char isDirectories, int *err);
+
+void fs_init(struct fuse_conn_info *conn){
+	uint64_t t0 = TRACE_BEGIN();
+	int err;
+	/* no FUSE_CAP_SPLICE_MOVE: the kernel must never steal bank pages */
+	if (conn -> capable & FUSE_CAP_SPLICE_WRITE)
+		conn -> want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn -> capable & FUSE_CAP_SPLICE_READ)
+		conn -> want |= FUSE_CAP_SPLICE_READ;
+	/* listings carry the attributes, ls -l needs no getattr per entry */
+	if (conn -> capable & FUSE_CAP_READDIRPLUS)
+		conn -> want |= FUSE_CAP_READDIRPLUS | (conn -> capable & FUSE_CAP_READDIRPLUS_AUTO);
+	/* dirty pages are flushed in any order, a write past EOF leaves a hole */
+	if (options.writeback && (conn -> capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn -> want |= FUSE_CAP_WRITEBACK_CACHE;
+	/* banks share one memfd so the low-level read can hand (fd, pos) pairs to the kernel
+	 * the mapping is only reserved here, bank_get opens banks on first use */
+	if (image_sb != NULL){
+		bank_fd = image_fd;
+	} else {
+		bank_fd = memfd_create("hello-banks", 0);
+		if (bank_fd < 0 || ftruncate(bank_fd, TOTAL_SIZE) < 0){
+			perror("bank memfd");
+			exit(1);
+		}
+	}
+	bank_base = mmap(NULL, TOTAL_SIZE, PROT_NONE, MAP_SHARED | MAP_NORESERVE, bank_fd, 0);
+	if (bank_base == MAP_FAILED){
+		perror("bank mmap");
+		exit(1);
+	}
+	int init_bank_i;
+	for (init_bank_i = 0;init_bank_i < BANK_NUM;init_bank_i++){
+		bank[init_bank_i] = bank_base + (size_t)init_bank_i * BANK_SIZE;
+	}
+	name_init();
+	root = new_inode("/", 1);
+	if (image_sb == NULL) memset(chunk_bits, 0, CHUNK_NUM / 8);
+	memset(chunk_full, 0, sizeof(chunk_full));
+	memset(bank_used, 0, sizeof(bank_used));
+	memset(bank_open, 0, sizeof(bank_open));
+	for (init_bank_i = 0;init_bank_i < CHUNK_SHARDS;init_bank_i++){
+		pthread_mutex_init(&chunk_shard[init_bank_i].lock, NULL);
+		chunk_shard[init_bank_i].hint = init_bank_i * SHARD_CHUNKS;
+	}
+	chunk_mark(0, 1);	/* chunk 0 stands for "unmapped" in block maps */
+	chunk_free = CHUNK_NUM - 1;
+	pthread_key_create(&chunk_cache_key, chunk_cache_drop);
+	pthread_key_create(&stats_key, stats_thread_exit);
+	pthread_key_create(&journal_key, journal_txn_free);
+	if (options.dedup) dedup_init();
+	compress_init();	/* an image may hold packed blocks without --compress */
+	sub_init();
+	stats_inode = MakeNode(root, STATS_NAME, 0, &err);
+	inode_put(stats_inode);
+	snap_inode = MakeNode(root, SNAP_NAME, 1, &err);
+	inode_put(snap_inode);
+	if (image_sb != NULL) image_load();
+	compress_start();
+	trace_init();
+	TRACE_END(t0, TR_INIT, 0, 0, 0, 0);
+}
+
+static void *hello_init(struct fuse_conn_info *conn,
+			struct fuse_config *cfg)
+{	
+	fs_init(conn);
+	cfg -> entry_timeout = options.timeout;
+	cfg -> attr_timeout = options.timeout;
+	if (options.cache){
+		cfg -> kernel_cache = 1;	/* page cache survives open() */
+		inval_start(NULL, fuse_get_context() -> fuse);
+	}
+	return NULL;
+}
+
+static void hello_destroy(void *private_data){
+	inval_end();
+	compress_end();
+	image_close();
+	trace_exit();
+}
+
+void fill_stat(struct inode *head, struct stat *stbuf){
+	memset(stbuf, 0, sizeof(struct stat));
+	pthread_rwlock_rdlock(&head -> lock);
+	if (head -> isDirectories == 1){
+		stbuf -> st_mode = S_IFDIR | (head -> readonly ? 0555 : 0666);
+		stbuf -> st_size = 0;
+	} else if (head == stats_inode){
+		stbuf -> st_mode = S_IFREG | 0444;	/* generated on read, opened direct_io */
+	} else {
+		stbuf -> st_mode = S_IFREG | (head -> readonly ? 0555 : 0777);
+		stbuf -> st_size = head -> size;
+	}
+	stbuf->st_ino = head -> ino;
+	stbuf->st_nlink = 1;            /* Count of links, set default one link. */
+	stbuf->st_uid = 0;              /* User ID, set default 0. */
+	stbuf->st_gid = 0;              /* Group ID, set default 0. */
+	stbuf->st_rdev = 0;             /* Device ID for special file, set default 0. */
+	stbuf->st_atime = 0;            /* Time of last access, set default 0. */
+	stbuf->st_mtime = head -> timeLastModified; /* Time of last modification. */
+	stbuf->st_ctime = 0;            /* Time of last creation or status change, set default 0. */
+	pthread_rwlock_unlock(&head -> lock);
+}
+
+static int hello_getattr(const char *path, struct stat *stbuf,
+			 struct fuse_file_info *fi)
+{
+	/* (void) fi;
+	int res = 0;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if (strcmp(path+1, options.filename) == 0) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = strlen(options.contents);
+	} else
+		res = -ENOENT;
+
+	return res; */
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	if (head == NULL){
+		TRACE_END(t0, TR_GETATTR, 0, 0, 0, -ENOENT);
+		return -2;
+	}
+	fill_stat(head, stbuf);
+	TRACE_END(t0, TR_GETATTR, head -> ino, 0, 0, 0);
+	inode_put(head);
+	return 0;
+}
+
+/* brief: hand the entries of dir past cookie offset to filler until
+ * it is full, straight from the son list under the read lock; with
+ * plus each entry carries its full attributes (parent before child) */
+int ReadDir(struct inode *dir, void *buf, fuse_fill_dir_t filler, off_t offset, int plus){
+	struct inode *now;
+	struct stat st;
+	if (dir -> isDirectories != 1) return -ENOTDIR;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR;
+	if (offset < 1 && filler(buf, ".", &st, 1, 0)) return 0;
+	if (offset < 2 && filler(buf, "..", &st, 2, 0)) return 0;
+	pthread_rwlock_rdlock(&dir -> lock);
+	for (now = dir_seek(dir, offset);now != NULL;now = now -> bro){
+		if (plus){
+			fill_stat(now, &st);
+		} else {
+			st.st_ino = now -> ino;
+			st.st_mode = (now -> isDirectories == 1) ? S_IFDIR : S_IFREG;
+		}
+		if (filler(buf, now -> filename, &st, now -> dpos, plus ? FUSE_FILL_DIR_PLUS : 0)) break;
+	}
+	dir_stop(dir, now);
+	pthread_rwlock_unlock(&dir -> lock);
+	return 0;
+}
+
+static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	/* (void) offset;
+	(void) fi;
+	(void) flags;
+
+	if (strcmp(path, "/") != 0)
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	filler(buf, options.filename, NULL, 0, 0);
+
+	return 0; */
+
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *dir = get_inode(path);
+	int plus = (flags & FUSE_READDIR_PLUS) != 0;
+	int res = dir == NULL ? -ENOENT : ReadDir(dir, buf, filler, offset, plus);
+	TRACE_END(t0, plus ? TR_READDIRPLUS : TR_READDIR, dir ? dir -> ino : 0, offset, 0, res);
+	inode_put(dir);
+	return res;
+}
+
+void Read_from_bank(uint32_t block, char *buf, size_t size, off_t chunk_offset){
+	memcpy(buf, block_addr(block) + chunk_offset, size);
+}
+
+/* brief: copy the next size bytes of src into the chunk, in place
+ * src may be memory or the pipe libfuse spliced the request into */
+ssize_t Write_to_bank(uint32_t block, struct fuse_bufvec *src, size_t size, off_t chunk_offset){
+	TRACE_EVENT(TR_BANK_WRITE, block, chunk_offset, size, 0);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = block_addr(block) + chunk_offset;
+	return fuse_buf_copy(&dst, src, 0);
+}
+
+/* brief: write into the bytes of an inline file, the write fits */
+int InlineWrite(struct inode *head, struct fuse_bufvec *src, size_t size, off_t offset){
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = head -> map.bytes + offset;
+	ssize_t res = fuse_buf_copy(&dst, src, 0);
+	if (res <= 0) return res;
+	if (offset + res > head -> size) head -> size = offset + res;
+	head -> timeLastModified = time(NULL);
+	image_data(head);
+	return res;
+}
+
+/* brief: an inline file is about to grow to end bytes, past
+ * INLINE_MAX; its bytes move to block 0 */
+int InlinePromote(struct inode *head, size_t end){
+	char bytes[INLINE_MAX];
+	memcpy(bytes, head -> map.bytes, INLINE_MAX);
+	memset(&head -> map, 0, sizeof(head -> map));
+	head -> inlined = 0;
+	if (head -> size == 0) return 0;
+	if (map_fit(head, end) < 0 || (head -> map.direct[0] == 0 && map_alloc(head, 0, 1) < 0)){
+		memcpy(head -> map.bytes, bytes, INLINE_MAX);
+		head -> inlined = 1;
+		return -ENOSPC;
+	}
+	memcpy(block_addr(head -> map.direct[0]), bytes, INLINE_MAX);
+	return 0;
+}
+
+/* brief: a file shrinks to size bytes, at most INLINE_MAX; they move
+ * back into the inode and every chunk goes */
+int InlineDemote(struct inode *head, size_t size){
+	char bytes[INLINE_MAX];
+	uint32_t v = head -> map.direct[0];
+	int err;
+	memset(bytes, 0, INLINE_MAX);
+	if (is_packed(v)){
+		if ((err = unpack_read(v, bytes, size, 0)) < 0) return err;
+	} else if (v != 0){
+		memcpy(bytes, block_addr(v), size);
+	}
+	map_punch(head, 0, MAX_BLOCKS);
+	memcpy(head -> map.bytes, bytes, INLINE_MAX);
+	head -> inlined = 1;
+	return 0;
+}
+
+/* brief: set the size of head, caller holds its write lock; blocks
+ * past the new end go and the rest of the last block is zeroed, a
+ * file that grows gets a hole */
+int TruncInode(struct inode *head, off_t size){
+	size_t keep = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	int err = 0;
+	if (size < 0) return -EINVAL;
+	if ((uint64_t)size > MAX_FILE_SIZE) return -EFBIG;
+	journal_begin();
+	if (head -> inlined){
+		if ((size_t)size > INLINE_MAX) err = InlinePromote(head, size);
+		else if ((size_t)size < head -> size) memset(head -> map.bytes + size, 0, head -> size - size);
+	} else if ((size_t)size <= head -> size && (size_t)size <= INLINE_MAX){
+		err = InlineDemote(head, size);
+	} else if ((size_t)size <= head -> size){
+		map_punch(head, keep, MAX_BLOCKS);	/* fallocate may have left blocks past EOF */
+		if ((size_t)size < head -> size && size % CHUNK_SIZE != 0)
+			err = map_zero(head, size, CHUNK_SIZE - size % CHUNK_SIZE);
+	} else if (is_sub(head -> map.direct[0])){
+		err = map_fit(head, size);
+	}
+	if (err == 0 && (size_t)size != head -> size){
+		head -> size = size;
+		head -> timeLastModified = time(NULL);
+	}
+	image_data(head);
+	journal_end();
+	return err;
+}
+
+/* brief: zero [offset, end) of head, whole blocks become holes */
+int PunchInode(struct inode *head, size_t offset, size_t end){
+	size_t first = (offset + CHUNK_SIZE - 1) / CHUNK_SIZE, last = end / CHUNK_SIZE;
+	int err = 0;
+	if (head -> inlined){
+		if (offset < INLINE_MAX) memset(head -> map.bytes + offset, 0, (end < INLINE_MAX ? end : INLINE_MAX) - offset);
+		return 0;
+	}
+	if (first > last) return map_zero(head, offset, end - offset);
+	if (offset % CHUNK_SIZE != 0) err = map_zero(head, offset, first * CHUNK_SIZE - offset);
+	if (err == 0 && end % CHUNK_SIZE != 0) err = map_zero(head, last * CHUNK_SIZE, end % CHUNK_SIZE);
+	if (err == 0) map_punch(head, first, last);
+	return err;
+}
+
+/* brief: fallocate(2) on head, caller holds its write lock. Mode 0 and
+ * FALLOC_FL_KEEP_SIZE give [offset, offset + length) chunks, contiguous
+ * as far as the allocator has them, so a writer that knows its final
+ * size allocates nothing while it writes; FALLOC_FL_PUNCH_HOLE (with
+ * KEEP_SIZE) frees the range again */
+int FallocInode(struct inode *head, int mode, off_t offset, off_t length){
+	size_t end = offset + length, blk = offset / CHUNK_SIZE;
+	size_t fit = end > head -> size ? end : head -> size;	/* block 0 serves the whole file */
+	int err = 0;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0) return -EINVAL;
+	if ((uint64_t)offset + length > MAX_FILE_SIZE) return -EFBIG;
+	journal_begin();
+	if (mode & FALLOC_FL_PUNCH_HOLE){
+		err = PunchInode(head, offset, end);
+	} else {
+		if (head -> inlined && end > INLINE_MAX) err = InlinePromote(head, fit);
+		if (err == 0 && !head -> inlined && (fit <= SUB_MAX || is_sub(head -> map.direct[0])))
+			err = map_fit(head, fit);
+		if (err == 0 && !head -> inlined) err = map_alloc(head, blk, (end + CHUNK_SIZE - 1) / CHUNK_SIZE - blk);
+		if (err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > head -> size) head -> size = end;
+	}
+	if (err == 0) head -> timeLastModified = time(NULL);
+	image_data(head);	/* map_alloc may have added chunks all the same */
+	journal_end();
+	return err;
+}
+
+/* brief: write into the chunks of head, caller holds its write lock
+ * a write past EOF leaves the gap a hole that costs no chunk (the
+ * writeback cache flushes pages in any order, downloaders and
+ * databases write at large offsets); bytes past EOF are always zero */
+int WriteInode(struct inode *head, struct fuse_bufvec *src, size_t size, off_t offset){
+	size_t write_size = 0;
+	int err = 0;
+	if ((uint64_t)offset + size > MAX_FILE_SIZE) return -EFBIG;
+	if (head -> inlined && offset + size <= INLINE_MAX) return InlineWrite(head, src, size, offset);
+	size_t end = offset + size > head -> size ? offset + size : head -> size;
+	journal_begin();
+	if ((head -> inlined && (err = InlinePromote(head, end)) < 0) ||
+	    ((end <= SUB_MAX || is_sub(head -> map.direct[0])) && (err = map_fit(head, end)) < 0)){
+		journal_end();
+		return err;
+	}
+	while (err == 0 && write_size < size){
+		off_t pos = offset + write_size;
+		size_t blk = pos / CHUNK_SIZE;
+		off_t write_offset = pos % CHUNK_SIZE;
+		size_t nblk = (write_offset + size - write_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		uint32_t chunk;
+		if ((err = map_alloc(head, blk, nblk)) < 0 || (err = map_own(head, blk, nblk)) < 0)
+			break;
+		size_t run = map_run(head, blk, nblk, &chunk), i;
+		size_t n = run * CHUNK_SIZE - write_offset;
+		if (n > size - write_size) n = size - write_size;
+		ssize_t res = Write_to_bank(chunk, src, n, write_offset);
+		if (res < 0){
+			err = res;
+			break;
+		}
+		for (i = 0;options.compress > 0 && !is_sub(chunk) && i < run;i++)
+			__atomic_store_n(&chunk_wtime[chunk + i], (uint32_t)time(NULL), __ATOMIC_RELAXED);
+		write_size += res;
+		if ((size_t)res < n) break;
+	}
+	if (write_size == 0 && err < 0){
+		image_data(head);	/* map_alloc may have added chunks all the same */
+		journal_end();
+		return err;
+	}
+	size_t full = (offset + CHUNK_SIZE - 1) / CHUNK_SIZE, full_end = (offset + write_size) / CHUNK_SIZE;
+	if (options.dedup && full_end > full) map_dedup(head, full, full_end - full);
+	if (offset + write_size > head -> size) head -> size = offset + write_size;
+	head -> timeLastModified = time(NULL);
+	image_data(head);
+	journal_end();
+	return write_size;
+}
+
+/* brief: write-combining buffer of an open file (--write-buffer)
+ * small sequential writes collect here and go to the chunks in one
+ * WriteInode call; an inode has at most one handle with pending data,
+ * so flushing never reorders writes made through different handles
+ * all of it runs under the write lock of the handle's inode */
+void wc_drop(struct open_file *h){
+	if (h -> inode -> wc_owner == h)
+		__atomic_store_n(&h -> inode -> wc_owner, NULL, __ATOMIC_RELEASE);
+	h -> wc_len = 0;
+}
+
+/* brief: commit the pending run; what cannot be written is dropped,
+ * the size (which counted it) goes back to what reached the chunks and
+ * the error stays on h for the owner to see */
+int wc_flush(struct open_file *h){
+	struct inode *head = h -> inode;
+	int res = 0;
+	if (h -> wc_len > 0){
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(h -> wc_len);
+		src.buf[0].mem = h -> wc;
+		int n = WriteInode(head, &src, h -> wc_len, h -> wc_off);
+		size_t done = n > 0 ? n : 0, end = h -> wc_off + done;
+		res = n < 0 ? n : done < h -> wc_len ? -ENOSPC : 0;
+		TRACE_EVENT(TR_WC_FLUSH, head -> ino, h -> wc_off, h -> wc_len, res);
+		if (res < 0){
+			head -> size = end > h -> wc_size ? end : h -> wc_size;
+			image_data(head);
+			h -> wc_err = res;
+		}
+	}
+	wc_drop(h);
+	return res;
+}
+
+/* brief: lock head to read it with no write pending in a buffer; the
+ * size counts buffered bytes already, so a reader that finds some takes
+ * the write lock instead and reads under the same hold it flushed in
+ * (wc_owner only changes under the write lock). Release as usual, also
+ * after an error: the flush failed, the reader fails with it and the
+ * owning handle keeps the error for its own flush */
+int wc_rdlock(struct inode *head){
+	int res = 0;
+	pthread_rwlock_rdlock(&head -> lock);
+	if (head -> wc_owner == NULL) return 0;
+	pthread_rwlock_unlock(&head -> lock);
+	pthread_rwlock_wrlock(&head -> lock);
+	if (head -> wc_owner != NULL) res = wc_flush(head -> wc_owner);
+	return res;
+}
+
+/* brief: write through handle h, absorbing the data when it extends the
+ * pending run and fits, otherwise flushing first and writing through */
+int WriteFileLocked(struct inode *head, struct open_file *h, struct fuse_bufvec *src, size_t size, off_t offset){
+	if (head -> wc_owner != NULL && head -> wc_owner != h){
+		int res = wc_flush(head -> wc_owner);
+		if (res < 0) return res;
+	}
+	if (h == NULL || h -> wc == NULL || size >= h -> wc_cap)
+		goto through;
+	if (h -> wc_len > 0 && (offset != h -> wc_off + (off_t)h -> wc_len || h -> wc_len + size > h -> wc_cap)){
+		int res = wc_flush(h);
+		if (res < 0) return res;
+	}
+	if (offset > head -> size || (head -> inlined && offset + size > INLINE_MAX))
+		goto through;	/* WriteInode promotes: an inlined size stays within INLINE_MAX */
+	if (h -> wc_len == 0){
+		h -> wc_off = offset;
+		h -> wc_size = head -> size;
+		__atomic_store_n(&head -> wc_owner, h, __ATOMIC_RELEASE);
+	}
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = h -> wc + h -> wc_len;
+	ssize_t res = fuse_buf_copy(&dst, src, 0);
+	if (res <= 0){
+		if (h -> wc_len == 0) wc_drop(h);
+		return res;
+	}
+	h -> wc_len += res;
+	if (offset + res > head -> size) head -> size = offset + res;
+	head -> timeLastModified = time(NULL);
+	return res;
+through:
+	if (h != NULL && h -> wc_len > 0){
+		int res = wc_flush(h);
+		if (res < 0) return res;
+	}
+	return WriteInode(head, src, size, offset);
+}
+
+int WriteFile(struct inode *head, struct open_file *h, struct fuse_bufvec *src, size_t size, off_t offset){
+	if (head == stats_inode) return -EACCES;
+	if (head -> readonly) return -EROFS;
+	pthread_rwlock_wrlock(&head -> lock);
+	int res = WriteFileLocked(head, h, src, size, offset);
+	pthread_rwlock_unlock(&head -> lock);
+	return res;
+}
+
+/* brief: truncate(2) (trunc set) or fallocate(2) of a regular file,
+ * buffered writes reach the chunks first */
+int SizeFile(struct inode *head, int trunc, int mode, off_t offset, off_t length){
+	int res = 0;
+	if (head == NULL) return -ENOENT;
+	if (head -> isDirectories == 1) return -EISDIR;
+	if (head == stats_inode) return -EACCES;
+	if (head -> readonly) return -EROFS;
+	pthread_rwlock_wrlock(&head -> lock);
+	if (head -> wc_owner != NULL) res = wc_flush(head -> wc_owner);
+	if (res == 0) res = trunc ? TruncInode(head, offset) : FallocInode(head, mode, offset, length);
+	pthread_rwlock_unlock(&head -> lock);
+	if (res == 0) inval_inode(head);
+	return res;
+}
+
+/* brief: lseek(2) SEEK_DATA/SEEK_HOLE on a regular file, the kernel
+ * does the other whences itself; the end of the file is a hole and
+ * blocks fallocate left past it do not count */
+off_t SeekFile(struct inode *head, off_t off, int whence){
+	size_t blk, end;
+	off_t res;
+	if (head == NULL) return -ENOENT;
+	if (head -> isDirectories == 1) return -EISDIR;
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+	if ((res = wc_rdlock(head)) < 0){
+		pthread_rwlock_unlock(&head -> lock);
+		return res;
+	}
+	if (off < 0 || (size_t)off >= head -> size){
+		res = -ENXIO;
+	} else if (head -> inlined){
+		res = whence == SEEK_DATA ? off : (off_t)head -> size;
+	} else {
+		end = (head -> size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		blk = map_seek(head, off / CHUNK_SIZE, end, whence == SEEK_DATA);
+		if (blk == end) res = whence == SEEK_DATA ? -ENXIO : (off_t)head -> size;
+		else res = (off_t)(blk * CHUNK_SIZE) > off ? (off_t)(blk * CHUNK_SIZE) : off;
+	}
+	pthread_rwlock_unlock(&head -> lock);
+	return res;
+}
+
+/* brief: compressor thread (--compress), see "Compression" above
+ * a file is worked on COMPRESS_BATCH blocks at a time under its write
+ * lock; with an image the journal group logging the new slots syncs
+ * the packs before it is written, and the old chunks are freed only
+ * once that group is durable, both waits after the lock is dropped */
+#define COMPRESS_BATCH 64
+pthread_t compress_thread;
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+int compress_running, compress_stop;
+uint32_t pack_cur;	/* pack being filled, the thread holds a reference */
+uint32_t pack_fill;	/* units of pack_cur in use */
+
+/* brief: compress chunk c into the current pack, its slot value or 0
+ * when it does not shrink enough */
+uint32_t pack_block(uint32_t c){
+	char out[PACK_LIMIT];
+	uint32_t len = lz_compress(chunk_addr(c), CHUNK_SIZE, out, PACK_LIMIT - sizeof(len)), units, v;
+	if (len == 0) return 0;
+	units = (sizeof(len) + len + PACK_UNIT - 1) / PACK_UNIT;
+	if (pack_cur == 0 || pack_fill + units > CHUNK_SIZE / PACK_UNIT){
+		int p = getFreeChunk();
+		if (p < 0) return 0;
+		if (pack_cur != 0) pack_put(PACKED | pack_cur << PACK_SLOT_BITS);
+		__atomic_store_n(&pack_refs[p], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pack_chunks, 1, __ATOMIC_RELAXED);
+		pack_cur = p;
+		pack_fill = 0;
+	}
+	v = PACKED | pack_cur << PACK_SLOT_BITS | pack_fill;
+	memcpy(pack_addr(v), &len, sizeof(len));
+	memcpy(pack_addr(v) + sizeof(len), out, len);
+	pack_fill += units;
+	pack_get(v);
+	return v;
+}
+
+/* brief: pack the cold blocks of head from blk on, at most
+ * COMPRESS_BATCH of them; caller holds head's write lock, returns
+ * where the next batch starts. The chunks the blocks had go to old,
+ * *nold of them, for compress_release */
+size_t compress_batch(struct inode *head, size_t blk, size_t nblk, uint32_t now, uint32_t *old, int *nold){
+	uint32_t *slot[COMPRESS_BATCH], val[COMPRESS_BATCH];
+	int n = 0, i;
+	*nold = 0;
+	if (head -> inlined) return nblk;
+	for (;n < COMPRESS_BATCH && (blk = map_seek(head, blk, nblk, 1)) < nblk;blk++){
+		uint32_t *s = map_slot(head, blk, 0), c = *s;
+		if (is_packed(c) || is_sub(c)) continue;
+		if ((int32_t)(now - __atomic_load_n(&chunk_wtime[c], __ATOMIC_RELAXED)) < options.compress) continue;
+		if (__atomic_load_n(&chunk_share[c], __ATOMIC_ACQUIRE) != 0 || (dedup_bits != NULL && dedup_has(c))) continue;
+		if ((val[n] = pack_block(c)) == 0){
+			__atomic_store_n(&chunk_wtime[c], now, __ATOMIC_RELAXED);	/* try again an interval later */
+			continue;
+		}
+		slot[n] = s;
+		old[n++] = c;
+	}
+	if (n == 0) return blk;
+	journal_begin();
+	journal_txn.data = journal_fd >= 0;	/* the packs go to disk ahead of the group */
+	for (i = 0;i < n;i++){
+		*slot[i] = val[i];
+		journal_map(head, slot[i]);
+	}
+	image_data(head);
+	journal_end();
+	*nold = n;
+	return blk;
+}
+
+/* brief: free the chunks a batch replaced once the group naming their
+ * packs is durable; called without the inode lock */
+void compress_release(uint32_t *old, int n){
+	int i;
+	if (n == 0 || journal_sync() < 0)
+		return;	/* the image may still name the old chunks, they stay taken */
+	for (i = 0;i < n;i++)
+		putChunk(old[i]);
+	__atomic_add_fetch(&packed_blocks, n, __ATOMIC_RELAXED);
+}
+
+/* brief: pack whatever has gone cold in every file, an unlinked file
+ * that is still open included */
+void compress_scan(void){
+	uint32_t now = time(NULL);
+	size_t ino, blk, nblk, end = __atomic_load_n(&ino_next, __ATOMIC_ACQUIRE);
+	uint32_t old[COMPRESS_BATCH];
+	int nold;
+	struct inode *head;
+	for (ino = FUSE_ROOT_ID + 1;ino < end && !__atomic_load_n(&compress_stop, __ATOMIC_RELAXED);ino++){
+		if ((head = inode_tryget(ino)) == NULL) continue;
+		for (blk = 0, nblk = 1;head -> isDirectories != 1 && head != stats_inode && blk < nblk;){
+			pthread_rwlock_wrlock(&head -> lock);
+			nblk = (head -> size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+			blk = compress_batch(head, blk, nblk, now, old, &nold);
+			pthread_rwlock_unlock(&head -> lock);
+			compress_release(old, nold);
+		}
+		inode_put(head);
+	}
+}
+
+void *compress_main(void *arg){
+	struct timespec ts;
+	pthread_mutex_lock(&compress_lock);
+	while (!compress_stop){
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += options.compress > 1 ? options.compress / 2 : 1;
+		pthread_cond_timedwait(&compress_cond, &compress_lock, &ts);
+		if (compress_stop) break;
+		pthread_mutex_unlock(&compress_lock);
+		compress_scan();
+		pthread_mutex_lock(&compress_lock);
+	}
+	pthread_mutex_unlock(&compress_lock);
+	return NULL;
+}
+
+void compress_start(void){
+	if (options.compress <= 0) return;
+	compress_running = pthread_create(&compress_thread, NULL, compress_main, NULL) == 0;
+}
+
+/* brief: stop the compressor before the image is closed, the pack it
+ * was filling keeps only the references of its blocks */
+void compress_end(void){
+	if (compress_running){
+		pthread_mutex_lock(&compress_lock);
+		__atomic_store_n(&compress_stop, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&compress_cond);
+		pthread_mutex_unlock(&compress_lock);
+		pthread_join(compress_thread, NULL);
+		compress_running = 0;
+	}
+	if (pack_cur != 0) pack_put(PACKED | pack_cur << PACK_SLOT_BITS);
+	pack_cur = 0;
+}
+
+#define STATS_BUF 8192
+
+/* brief: text of STATS_NAME, allocator occupancy then one line per
+ * operation, latencies in microseconds */
+size_t stats_render(char *buf, size_t cap){
+	struct op_stats *sum = malloc(TR_NOPS * sizeof(struct op_stats));
+	struct trace_ring *r;
+	size_t used = 0, nfree = __atomic_load_n(&chunk_free, __ATOMIC_RELAXED);
+	uint32_t dropped, nopen = 0, nfull = 0;
+	uint64_t commits, txns;
+	int i;
+	if (sum == NULL) return 0;
+	for (i = 0;i < BANK_NUM;i++){
+		nopen += __atomic_load_n(&bank_open[i], __ATOMIC_RELAXED) != 0;
+		nfull += __atomic_load_n(&bank_used[i], __ATOMIC_RELAXED) == CHUNK_PER_BANK;
+	}
+	pthread_mutex_lock(&trace_lock);
+	dropped = trace_dropped_gone;
+	for (r = trace_rings;r != NULL;r = r -> next)
+		dropped += __atomic_load_n(&r -> dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_mutex_lock(&journal_lock);
+	commits = journal_commits;
+	txns = journal_txns;
+	pthread_mutex_unlock(&journal_lock);
+	stats_sum(sum);
+#define EMIT(...) do { int n_ = snprintf(buf + used, cap - used, __VA_ARGS__); \
+		if (n_ > 0) used = (size_t)n_ < cap - used ? used + n_ : cap - 1; } while (0)
+	EMIT("chunk_size %d\nchunks_total %lu\nchunks_used %lu\nchunks_free %lu\nchunks_shared %lu\ndedup_hits %lu\n",
+	     CHUNK_SIZE, (unsigned long)(CHUNK_NUM - 1), (unsigned long)(CHUNK_NUM - 1 - nfree), (unsigned long)nfree,
+	     (unsigned long)__atomic_load_n(&chunk_shared, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&dedup_hits, __ATOMIC_RELAXED));
+	EMIT("sub_blocks_512 %lu\nsub_blocks_2k %lu\nsub_blocks_8k %lu\n",
+	     (unsigned long)__atomic_load_n(&sub_class[0].nblocks, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&sub_class[1].nblocks, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&sub_class[2].nblocks, __ATOMIC_RELAXED));
+	EMIT("packed_blocks %lu\npack_chunks %lu\nunpack_misses %lu\n",
+	     (unsigned long)__atomic_load_n(&packed_blocks, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&pack_chunks, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&unpack_misses, __ATOMIC_RELAXED));
+	EMIT("inodes %lu\nnames %lu\nmeta_bytes %lu\n",
+	     (unsigned long)__atomic_load_n(&inode_slab.nobj, __ATOMIC_RELAXED),
+	     (unsigned long)__atomic_load_n(&name_count, __ATOMIC_RELAXED), (unsigned long)slab_bytes());
+	EMIT("banks_total %lu\nbanks_open %u\nbanks_full %u\n", (unsigned long)BANK_NUM, nopen, nfull);
+	EMIT("trace_level %d\ntrace_dropped %u\n", __atomic_load_n(&trace_level, __ATOMIC_RELAXED), dropped);
+	EMIT("journal_txns %lu\njournal_commits %lu\n", (unsigned long)txns, (unsigned long)commits);
+	EMIT("%-9s %10s %8s %14s %10s %10s %10s %10s %10s\n",
+	     "op", "count", "errors", "bytes", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (i = 1;i < TR_NOPS;i++){
+		struct op_stats *o = &sum[i];
+		int b;
+		if (o -> count == 0) continue;
+		for (b = STATS_BUCKETS - 1;b > 0 && o -> hist[b] == 0;b--);
+		EMIT("%-9s %10lu %8lu %14lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", trace_op_name[i],
+		     (unsigned long)o -> count, (unsigned long)o -> errors, (unsigned long)o -> bytes,
+		     o -> ns / 1000.0 / o -> count, stats_percentile(o, 0.5) / 1000.0,
+		     stats_percentile(o, 0.9) / 1000.0, stats_percentile(o, 0.99) / 1000.0,
+		     (b == STATS_BUCKETS - 1 ? stats_bucket_low(b) : stats_bucket_low(b + 1) - 1) / 1000.0);
+	}
+#undef EMIT
+	free(sum);
+	return used;
+}
+
+/* brief: STATS_NAME is regenerated on every read, a reader that wants
+ * one consistent snapshot reads it in one go */
+int StatsRead(char *buf, size_t size, off_t offset){
+	char *text = malloc(STATS_BUF);
+	size_t len;
+	if (text == NULL) return -ENOMEM;
+	len = stats_render(text, STATS_BUF);
+	if (offset >= len) size = 0;
+	else if (size > len - offset) size = len - offset;
+	memcpy(buf, text + offset, size);
+	free(text);
+	return size;
+}
+
+/* brief: copy out of the chunks of head */
+int ReadInode(struct inode *head, char *buf, size_t size, off_t offset){
+	size_t read_size = 0;
+	int err = 0;
+	if (head == stats_inode) return StatsRead(buf, size, offset);
+	if ((err = wc_rdlock(head)) < 0){
+		pthread_rwlock_unlock(&head -> lock);
+		return err;
+	}
+	if (offset >= head -> size) size = 0;
+	else if (size > head -> size - offset) size = head -> size - offset;
+	if (head -> inlined){
+		if (offset + size > INLINE_MAX) size = offset < INLINE_MAX ? INLINE_MAX - offset : 0;
+		memcpy(buf, head -> map.bytes + offset, size);
+		read_size = size;
+	}
+	while (read_size < size){
+		off_t pos = offset + read_size;
+		size_t blk = pos / CHUNK_SIZE;
+		off_t read_offset = pos % CHUNK_SIZE;
+		uint32_t chunk;
+		size_t run = map_run(head, blk, (read_offset + size - read_size + CHUNK_SIZE - 1) / CHUNK_SIZE, &chunk);
+		size_t n = (run ? run : 1) * CHUNK_SIZE - read_offset;
+		if (n > size - read_size) n = size - read_size;
+		if (run == 0) memset(buf + read_size, 0, n);	/* a hole */
+		else if (!is_packed(chunk)) Read_from_bank(chunk, buf + read_size, n, read_offset);
+		else if ((err = unpack_read(chunk, buf + read_size, n, read_offset)) < 0) break;
+		read_size += n;
+	}
+	pthread_rwlock_unlock(&head -> lock);
+	return read_size == 0 && err < 0 ? err : (int)read_size;
+}
+
+static int hello_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	/* size_t len;
+	(void) fi;
+	if(strcmp(path+1, options.filename) != 0)
+		return -ENOENT;
+
+	len = strlen(options.contents);
+	if (offset < len) {
+		if (offset + size > len)
+			size = len - offset;
+		memcpy(buf, options.contents + offset, size);
+	} else
+		size = 0;
+
+	return size; */
+
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	int res = -1;
+	if (head != NULL && head -> isDirectories != 1)
+		res = ReadInode(head, buf, size, offset);
+	TRACE_END(t0, TR_READ, head ? head -> ino : 0, offset, res > 0 ? res : 0, res);
+	inode_put(head);
+	return res;
+}
+
+/* brief: free what ReadInodeBuf returned */
+void bufvec_free(struct fuse_bufvec *bv){
+	size_t i;
+	for (i = 0;i < bv -> count;i++)
+		if (!(bv -> buf[i].flags & FUSE_BUF_IS_FD)) free(bv -> buf[i].mem);
+	free(bv);
+}
+
+/* brief: zero-copy read, every slice is a (bank_fd, pos) buffer
+ * each physically contiguous run of chunks becomes one fuse_buf, the
+ * kernel can then splice straight from the bank memfd; a packed block
+ * is decompressed into a memory slice of its own
+ * on success head stays locked, nothing can free the chunks until the
+ * reply is sent and ReadInodeBufDone is called */
+int ReadInodeBuf(struct inode *head, struct fuse_bufvec **bufp, size_t size, off_t offset){
+	if (head == stats_inode){
+		struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+		int res;
+		if (bv == NULL) return -ENOMEM;
+		*bv = FUSE_BUFVEC_INIT(size);
+		bv -> buf[0].mem = malloc(size);
+		res = bv -> buf[0].mem == NULL ? -ENOMEM : StatsRead(bv -> buf[0].mem, size, offset);
+		if (res < 0){
+			free(bv -> buf[0].mem);
+			free(bv);
+			return res;
+		}
+		bv -> buf[0].size = res;
+		*bufp = bv;
+		return 0;
+	}
+	int err = wc_rdlock(head);
+	if (err < 0){
+		pthread_rwlock_unlock(&head -> lock);
+		return err;
+	}
+	if (offset >= head -> size) size = 0;
+	else if (size > head -> size - offset) size = head -> size - offset;
+	size_t nbuf = size / CHUNK_SIZE + 2;
+	struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec) + nbuf * sizeof(struct fuse_buf));
+	if (bv == NULL){
+		pthread_rwlock_unlock(&head -> lock);
+		return -ENOMEM;
+	}
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv -> count = 0;
+	size_t read_size = 0;
+	if (head -> inlined && offset + size > INLINE_MAX) size = offset < INLINE_MAX ? INLINE_MAX - offset : 0;
+	if (head -> inlined && size > 0){
+		bv -> count = 1;
+		bv -> buf[0].size = size;
+		bv -> buf[0].mem = malloc(size);
+		if (bv -> buf[0].mem == NULL){
+			pthread_rwlock_unlock(&head -> lock);
+			free(bv);
+			return -ENOMEM;
+		}
+		memcpy(bv -> buf[0].mem, head -> map.bytes + offset, size);
+		read_size = size;
+	}
+	while (read_size < size){
+		off_t pos = offset + read_size;
+		size_t blk = pos / CHUNK_SIZE;
+		off_t read_offset = pos % CHUNK_SIZE;
+		uint32_t chunk;
+		size_t run = map_run(head, blk, (read_offset + size - read_size + CHUNK_SIZE - 1) / CHUNK_SIZE, &chunk);
+		size_t n = (run ? run : 1) * CHUNK_SIZE - read_offset;
+		if (n > size - read_size) n = size - read_size;
+		struct fuse_buf *b = &bv -> buf[bv -> count++];
+		b -> size = n;
+		b -> flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b -> mem = NULL;
+		b -> fd = bank_fd;
+		b -> pos = block_pos(chunk) + read_offset;
+		if (run == 0 || is_packed(chunk)){	/* a hole is zeros from memory, no bank page */
+			b -> flags = 0;
+			b -> fd = -1;
+			b -> pos = 0;
+			b -> mem = run == 0 ? calloc(1, n) : malloc(n);
+			int res = b -> mem == NULL ? -ENOMEM : run == 0 ? 0 : unpack_read(chunk, b -> mem, n, read_offset);
+			if (res < 0){
+				pthread_rwlock_unlock(&head -> lock);
+				bufvec_free(bv);
+				return res;
+			}
+		}
+		read_size += n;
+	}
+	if (bv -> count == 0){
+		bv -> count = 1;
+		bv -> buf[0].size = 0;
+	}
+	*bufp = bv;
+	return 0;
+}
+
+/* brief: after the reply to ReadInodeBuf went out */
+void ReadInodeBufDone(struct inode *head, struct fuse_bufvec *bv){
+	if (head != stats_inode) pthread_rwlock_unlock(&head -> lock);
+	bufvec_free(bv);
+}
+
+struct open_file *open_file_new(struct fuse_file_info *fi, struct inode *head){
+	if (options.write_buffer <= 0 || (fi -> flags & O_ACCMODE) == O_RDONLY) return NULL;
+	struct open_file *h = slab_alloc(&open_file_slab);
+	if (h == NULL) return NULL;
+	inode_get(head);
+	h -> inode = head;
+	h -> wc_cap = options.write_buffer;
+	h -> wc = malloc(h -> wc_cap);
+	fi -> fh = (uintptr_t)h;
+	return h;
+}
+
+/* brief: the kernel must not cache STATS_NAME nor trust its size */
+int OpenStats(struct fuse_file_info *fi){
+	if ((fi -> flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+	fi -> direct_io = 1;
+	return 0;
+}
+
+static int hello_open(const char *path, struct fuse_file_info *fi){
+	/*if (strcmp(path+1, options.filename) != 0)
+		return -ENOENT;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;*/
+
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	int res = 0;
+	if (head == NULL){
+		TRACE_END(t0, TR_OPEN, 0, 0, 0, -ENOENT);
+		return -ENOENT;
+	}
+	if (head == stats_inode){
+		res = OpenStats(fi);
+	} else if (head -> readonly && (fi -> flags & O_ACCMODE) != O_RDONLY){
+		res = -EROFS;
+	} else if (head -> isDirectories != 1){
+		open_file_new(fi, head);
+	}
+	TRACE_END(t0, TR_OPEN, head -> ino, 0, 0, res);
+	inode_put(head);
+	return res;
+}
 
+/* brief: push the handle's pending writes, the trace carries the ino
+ * of the handle (0 without --write-buffer, there is nothing to push) */
+int FlushFile(struct fuse_file_info *fi, int op){
+	struct open_file *h = (struct open_file *)(uintptr_t)fi -> fh;
+	uint64_t t0 = TRACE_BEGIN();
+	int res = 0;
+	if (h != NULL){
+		pthread_rwlock_wrlock(&h -> inode -> lock);
+		wc_flush(h);
+		res = h -> wc_err;	/* reported once, like a failed writeback */
+		h -> wc_err = 0;
+		pthread_rwlock_unlock(&h -> inode -> lock);
+	}
+	if (op == TR_FSYNC && image_fd >= 0){
+		int err = fdatasync(image_fd) < 0 ? -EIO : journal_sync();	/* the data, the journal has the rest */
+		if (res == 0) res = err;
+	}
+	TRACE_END(t0, op, h ? h -> inode -> ino : 0, 0, 0, res);
+	return res;
 }
 
-static int hello_open(const char *path, struct fuse_file_info *fi){
-	/*if (strcmp(path+1, options.filename) != 0)
-		return -ENOENT;
+static int hello_flush(const char *path, struct fuse_file_info *fi){
+	return FlushFile(fi, TR_FLUSH);
+}
 
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;*/
+static int hello_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	return FlushFile(fi, TR_FSYNC);
+}
 
-	return 0;
+static int hello_release(const char *path, struct fuse_file_info *fi){
+	struct open_file *h = (struct open_file *)(uintptr_t)fi -> fh;
+	int res;
+	if (h == NULL) return 0;
+	res = FlushFile(fi, TR_RELEASE);
+	inode_put(h -> inode);
+	free(h -> wc);
+	slab_free(&open_file_slab, h);
+	return res;
 }
 
-void Read_from_bank(int chunk_index, char *buf, size_t size, off_t chunk_offset){
-	void *tbank = (bank[chunk_index/(CHUNK_NUM / BANK_NUM)]);
-	int times = chunk_index % (CHUNK_NUM / BANK_NUM);
-	off_t offset = chunk_offset + times * CHUNK_SIZE;
-	size_t Tsize = chunk_offset + size + times * CHUNK_SIZE;
-	memcpy(local_buf, tbank, Tsize);
-	memcpy(buf, local_buf + offset, size);
+static int hello_access(const char *path, int mask){
+	return 0;
 }
 
-static int hello_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
-{
-	/* size_t len;
-	(void) fi;
-	if(strcmp(path+1, options.filename) != 0)
-		return -ENOENT;
+/*
+ * Snapshots
+ *
+ * mkdir SNAP_NAME/<name> copies the tree to a read-only directory of
+ * that name. Only metadata is copied: the copies share the data chunks
+ * (chunk_share counts the extra owners) and get map chunks of their own,
+ * a write to a shared chunk copies it first (map_own). rmdir of the
+ * snapshot drops it whole. Writes go on meanwhile, each file is copied
+ * in one piece under its lock, renames wait for the whole snapshot.
+ */
 
-	len = strlen(options.contents);
-	if (offset < len) {
-		if (offset + size > len)
-			size = len - offset;
-		memcpy(buf, options.contents + offset, size);
-	} else
-		size = 0;
+void DeleteAll(struct inode *dir);
+void DropInode(struct inode *head);
 
-	return size; */
+pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;	/* one snapshot at a time */
 
-	DEBUG("begin read");
-	DEBUG_END();
-	char *bbuf = malloc(size);
-	char filename[FILE_NAME_LEN];
-	int len = strlen(path);
-	strcpy(filename, path);
-	filename[len] = '/';
-	filename[len + 1] = 0;
-	struct inode *head = get_father_inode(filename);
-	if (head == NULL || head -> isDirectories == 1) return -1;
-	struct context *cnt = head -> context;
-	if (cnt == NULL) return 0;
-	off_t read_offset = offset;
-	int i = read_offset / CHUNK_SIZE;
-	DEBUG("i:");
-	DEBUG_INT(i);
-	DEBUG_END();
-	DEBUG_INT(size);
-	DEBUG_INT(cnt -> size);
-	while (i > 0){
-		if (cnt == NULL || cnt -> size != CHUNK_SIZE){
-			DEBUG("file system read error1\n"); 
-			return 0;
+/* brief: copy the entries of src into dst, which is not reachable yet
+ * src is read locked throughout, a file also while its map is copied */
+int snap_clone(struct inode *dst, struct inode *src){
+	struct inode *now, *copy;
+	int err = 0;
+	pthread_rwlock_rdlock(&src -> lock);
+	dst -> timeLastModified = src -> timeLastModified;
+	for (now = src -> son;now != NULL && err == 0;now = now -> bro){
+		if (now == stats_inode || now == snap_inode) continue;
+		if ((copy = new_inode(now -> filename, now -> isDirectories)) == NULL){
+			err = -ENOSPC;
+			break;
 		}
-		cnt = cnt -> next;
-		i--;
-	}
-	read_offset = read_offset % CHUNK_SIZE;
-	DEBUG_INT(read_offset);
-	size_t read_size = 0, un_read_size = size;
-	while (un_read_size > 0){
-		if (cnt == NULL){
-			break; //a read will read a page size
-		}
-		if (un_read_size >= cnt -> size - read_offset){
-			Read_from_bank(cnt -> chunk_index, bbuf + read_size, cnt -> size - read_offset, read_offset);
-			read_size += cnt -> size - read_offset;
-			un_read_size -= cnt -> size - read_offset;
-			read_offset = 0;
-		} else {
-			Read_from_bank(cnt -> chunk_index, bbuf + read_size, un_read_size, read_offset);
-			read_size += un_read_size;
-			un_read_size = 0;
+		copy -> readonly = 1;
+		dir_insert(dst, copy);
+		if (now -> isDirectories == 1){
+			err = snap_clone(copy, now);
+			continue;
 		}
-		cnt = cnt -> next;
+		if ((err = wc_rdlock(now)) < 0){
+			pthread_rwlock_unlock(&now -> lock);
+			break;
+		}
+		pthread_rwlock_wrlock(&copy -> lock);	/* the compressor finds it by number */
+		copy -> size = now -> size;
+		copy -> timeLastModified = now -> timeLastModified;
+		err = map_clone(copy, now);
+		pthread_rwlock_unlock(&copy -> lock);
+		pthread_rwlock_unlock(&now -> lock);
 	}
-	bbuf[read_size] = 0;
-	memcpy(buf,bbuf,read_size);
-	free(bbuf);
-	return read_size;
+	pthread_rwlock_unlock(&src -> lock);
+	return err;
 }
 
-static int hello_access(const char *path, int mask){
+/* brief: write the slots of the entries under dir, caller holds the
+ * lock of SNAP_NAME; the map chunks they name are on disk already */
+int snap_publish(struct inode *dir){
+	struct inode *now;
+	long name_chunk;
+	for (now = dir -> son;now != NULL;now = now -> bro){
+		if ((name_chunk = image_name_alloc(now -> filename)) < 0) return -ENOSPC;
+		if (now -> isDirectories != 1) pthread_rwlock_rdlock(&now -> lock);	/* the compressor */
+		image_data(now);
+		if (now -> isDirectories != 1) pthread_rwlock_unlock(&now -> lock);
+		image_name(now, name_chunk);
+		if (now -> isDirectories == 1 && snap_publish(now) < 0) return -ENOSPC;
+	}
 	return 0;
 }
 
+/* brief: MakeNode under SNAP_NAME, only directories can be made there */
+struct inode *MakeSnapshot(const char *name, char isDirectories, int *err){
+	struct inode *snap;
+	long name_chunk;
+	if (!isDirectories){
+		*err = -EPERM;
+		return NULL;
+	}
+	pthread_mutex_lock(&snap_lock);
+	if ((snap = dir_get(snap_inode, name, strlen(name))) != NULL){
+		inode_put(snap);
+		pthread_mutex_unlock(&snap_lock);
+		*err = -EEXIST;
+		return NULL;
+	}
+	if ((snap = new_inode(name, 1)) == NULL){
+		pthread_mutex_unlock(&snap_lock);
+		*err = -ENOSPC;
+		return NULL;
+	}
+	snap -> readonly = 1;
+	pthread_mutex_lock(&rename_lock);
+	*err = snap_clone(snap, root);
+	pthread_mutex_unlock(&rename_lock);
+	/* the copied map chunks are not journaled, they reach the image first */
+	if (*err == 0 && image_fd >= 0 && fdatasync(image_fd) < 0) *err = -EIO;
+	if (*err == 0 && (name_chunk = image_name_alloc(name)) < 0) *err = -ENOSPC;
+	if (*err == 0){
+		pthread_rwlock_wrlock(&snap_inode -> lock);
+		journal_begin();
+		dir_insert(snap_inode, snap);
+		snap_inode -> timeLastModified = time(NULL);
+		image_data(snap);
+		image_name(snap, name_chunk);
+		image_data(snap_inode);
+		*err = snap_publish(snap);
+		journal_end();
+		if (*err < 0) dir_unlink(snap_inode, snap);
+		else inode_get(snap);
+		pthread_rwlock_unlock(&snap_inode -> lock);
+	}
+	pthread_mutex_unlock(&snap_lock);
+	if (*err < 0){
+		DeleteAll(snap);
+		DropInode(snap);
+		return NULL;
+	}
+	if ((*err = journal_sync()) < 0){
+		inode_put(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+/* brief: create filename under father, NULL with *err set on failure
+ * the new inode comes back referenced for the caller */
+struct inode *MakeNode(struct inode *father, const char *filename, char isDirectories, int *err){
+	struct inode *now = NULL;
+	long name_chunk;
+	if (father == NULL || father -> isDirectories != 1){
+		*err = -ENOTDIR;
+		return NULL;
+	}
+	if (strlen(filename) >= FILE_NAME_LEN - 1){
+		*err = -ENAMETOOLONG;
+		return NULL;
+	}
+	if (father -> readonly){
+		*err = -EROFS;
+		return NULL;
+	}
+	if (father == snap_inode) return MakeSnapshot(filename, isDirectories, err);
+	if ((name_chunk = image_name_alloc(filename)) < 0){
+		*err = -ENOSPC;
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&father -> lock);
+	if (dir_dead(father)){
+		*err = -ENOENT;
+	} else if (dir_lookup(father, filename, strlen(filename)) != NULL){
+		*err = -EEXIST;
+	} else if ((now = new_inode(filename, isDirectories)) == NULL){
+		*err = -ENOSPC;
+	} else {
+		journal_begin();
+		dir_insert(father, now);
+		father -> timeLastModified = time(NULL);
+		image_data(now);
+		image_name(now, name_chunk);
+		image_data(father);
+		journal_end();
+		name_chunk = 0;
+		inode_get(now);
+	}
+	pthread_rwlock_unlock(&father -> lock);
+	if (name_chunk > 0) putChunk(name_chunk);
+	if (now != NULL && (*err = journal_sync()) < 0){
+		inode_put(now);
+		return NULL;
+	}
+	return now;
+}
+
 int CreateDirectory(const char *path){
 	if (strlen(path) == 0) return 0;
 	char filename[FILE_NAME_LEN], dirname[FILE_NAME_LEN];
+	int err;
 	deal(path, dirname, filename);
-	struct inode * now = malloc(sizeof(struct inode));
-	now -> isDirectories = 1;
-	now -> son = NULL;
-	now -> size = 0;
-	now -> timeLastModified = time(NULL);
-	memset(now -> filename, 0, FILE_NAME_LEN);
-	strcpy(now -> filename, filename);
 	struct inode *father = get_father_inode(dirname);
-	if (father == NULL) return -1;
-	if (father -> isDirectories == 0) return -1;
-	struct inode *tmp = father -> son;
-	father -> son = now;
-	now -> bro = tmp;
+	struct inode *now = MakeNode(father, filename, 1, &err);
+	inode_put(father);
+	if (now == NULL) return err;
+	inode_put(now);
 	return 1;
 }
 
 static int hello_mkdir(const char *path, mode_t mode){
-	DEBUG("begin mkdir");
-	DEBUG_END();
+	uint64_t t0 = TRACE_BEGIN();
 	int res = CreateDirectory(path);
-	DEBUG_INT(res);
-	DEBUG_END();
-	if (res < 0)
-		return -1;
-	else
-		return 0;
+	TRACE_END(t0, TR_MKDIR, 0, 0, 0, res < 0 ? res : 0);
+	return res < 0 ? res : 0;
 }
 
-int CreateFile(const char *path){
+/* brief: fi is set when the file is opened as well (create) */
+int CreateFile(const char *path, struct fuse_file_info *fi){
 	if (strlen(path) == 1){
 		return 0;
 	}
 	char filename[FILE_NAME_LEN], dirname[FILE_NAME_LEN];
+	int err;
 	deal(path,dirname,filename);
-	struct inode *father = get_father_inode(dirname);
-	if (father == NULL){
-		DEBUG("Error path to MKnod\n");
-		return -1;
+	struct inode *father = get_father_inode(dirname), *now;
+	if (father == NULL || father -> isDirectories != 1){
+		inode_put(father);
+		return -ENOENT;
 	}
-	{
-		char filename[FILE_NAME_LEN];
-		int len = strlen(path);
-		strcpy(filename, path);
-		filename[len] = '/';
-		filename[len + 1] = 0;
-		struct inode* head = get_father_inode(filename);
-		if (head != NULL){
-			DEBUG("MKnod same file fail\n");
-			return -1;
-		}
-	}
-	struct inode* now = malloc(sizeof(struct inode));
-	now -> isDirectories = 0;
-	now -> son = NULL;
-	now -> bro = NULL;
-	now -> size = 0;
-	now -> timeLastModified = time(NULL);
-	now -> context = NULL;
-	memset(now -> filename, 0, FILE_NAME_LEN);
-	strcpy(now -> filename, filename);
-	struct inode* tmp = father -> son;
-	DEBUG("CreateFile");
-	DEBUG_END();
-	father -> son = now;
-	now -> bro = tmp;
+	now = MakeNode(father, filename, 0, &err);
+	inode_put(father);
+	if (now == NULL){
+		return err;
+	}
+	if (fi != NULL) open_file_new(fi, now);
+	inode_put(now);
 	return 1;
 }
 
 static int hello_mknod(const char *path, mode_t mode, dev_t rdev){
-	DEBUG("begin mknod\n");
-	DEBUG(path);
-	DEBUG_END();
-	int res = CreateFile(path);
-	DEBUG_INT(res);
-	DEBUG_END();
-	if (res < 0){
-		return -1;
-	} else {
-		return 0;
-	}
+	uint64_t t0 = TRACE_BEGIN();
+	int res = CreateFile(path, NULL);
+	TRACE_END(t0, TR_MKNOD, 0, 0, 0, res < 0 ? res : 0);
+	return res < 0 ? res : 0;
 }
 
+/* brief: called by the last inode_put, nobody can reach head any more
+ * (open handles hold references, so no write is pending either) */
 void FreeInode(struct inode *head){
 	if (head == NULL) return;
-	struct context *context = head -> context, *tmp;
-	while (context != NULL){
-		tmp = context;
-		bitmap[tmp -> chunk_index] = 0;
-		context = context -> next;
-		free(tmp);
-	}
-	free(head);
+	map_free(head);
+	ino_release(head);
+	pthread_rwlock_destroy(&head -> lock);
+	free(head -> bucket);
+	name_put(head -> filename);
+	slab_free(&inode_slab, head);
 }
 
-void DeleteAll(struct inode *head){
-	if (head == NULL) return;
-	if (head -> bro != NULL){
-		DeleteAll(head -> bro);
-	}
-	if (head -> isDirectories == 1 && head -> son != NULL){
-		DeleteAll(head -> son);
+/* brief: an inode just left the namespace, drop its directory entry's
+ * reference; kernel lookups, handles and walkers keep it alive */
+void DropInode(struct inode *head){
+	inode_put(head);
+}
+
+/* brief: empty an unlinked directory, subdirectories first */
+void DeleteAll(struct inode *dir){
+	struct inode *now;
+	for (;;){
+		pthread_rwlock_wrlock(&dir -> lock);
+		now = dir -> son;
+		if (now != NULL){
+			if (now -> isDirectories == 1) pthread_rwlock_wrlock(&now -> lock);
+			dir_unlink(dir, now);
+			if (now -> isDirectories == 1) pthread_rwlock_unlock(&now -> lock);
+		}
+		pthread_rwlock_unlock(&dir -> lock);
+		if (now == NULL) return;
+		inval_entry(dir, now -> filename);
+		if (now -> isDirectories == 1) DeleteAll(now);
+		DropInode(now);
 	}
-	FreeInode(head);
 }
 
 int DelFromInode(struct inode *head,char *filename){
-	struct inode *tmp, *ttmp;
-	tmp = head -> son;
-	if (tmp == NULL) return 0;
-	if (strcmp(filename, tmp -> filename) == 0){
-		head -> son = tmp -> bro;
-		tmp -> bro = NULL;
-		if (tmp -> isDirectories == 1)
-			DeleteAll(tmp -> son);
-		FreeInode(tmp);
-		return 0;
+	if (head -> readonly) return -EROFS;
+	pthread_rwlock_wrlock(&head -> lock);
+	struct inode *tmp = dir_lookup(head, filename, strlen(filename));
+	if (tmp == stats_inode || tmp == snap_inode){
+		pthread_rwlock_unlock(&head -> lock);
+		return -EPERM;
 	}
-	while (tmp -> bro != NULL){
-		ttmp = tmp;
-		tmp = tmp -> bro;
-		if (strcmp(filename, tmp -> filename) == 0){
-			ttmp -> bro = tmp -> bro;
-			tmp -> bro = NULL;
-			if (tmp -> isDirectories == 1)
-				DeleteAll(tmp -> son);
-			FreeInode(tmp);
-			return 0;
-		}
+	if (tmp != NULL){
+		if (tmp -> isDirectories == 1) pthread_rwlock_wrlock(&tmp -> lock);
+		dir_unlink(head, tmp);
+		if (tmp -> isDirectories == 1) pthread_rwlock_unlock(&tmp -> lock);
 	}
-	return -1;
+	pthread_rwlock_unlock(&head -> lock);
+	if (tmp == NULL) return -ENOENT;
+	inval_entry(head, filename);
+	if (tmp -> isDirectories == 1)
+		DeleteAll(tmp);
+	DropInode(tmp);
+	return journal_sync();
 }
 
 int Delete(const char *path){
@@ -578,129 +4153,62 @@ int Delete(const char *path){
 	char filename[FILE_NAME_LEN], dirname[FILE_NAME_LEN];
 	deal(path, dirname, filename);
 	struct inode *father = get_father_inode(dirname);
-	if (father == NULL) return -1;
-	return DelFromInode(father, filename);
+	if (father == NULL) return -ENOENT;
+	int res = DelFromInode(father, filename);
+	inode_put(father);
+	return res;
 }
 
 static int hello_rmdir(const char *path){
-	DEBUG("begin rmdir");
-	DEBUG_END();
+	uint64_t t0 = TRACE_BEGIN();
 	int res = Delete(path);
-	if (res < 0){
-		return -2;
-	} else {
-		return 0;
-	}
+	TRACE_END(t0, TR_RMDIR, 0, 0, 0, res);
+	return res;
 }
 
 static int hello_unlink(const char *path){
-	DEBUG("begin unlink");
-	DEBUG_END();
+	uint64_t t0 = TRACE_BEGIN();
 	int res = Delete(path);
-	if (res < 0){
-		return -2;
-	} else {
-		return 0;
-	}
+	TRACE_END(t0, TR_UNLINK, 0, 0, 0, res);
+	return res;
 }
 
-void Write_to_bank(int chunk_index, const char *buf, size_t size, off_t chunk_offset){
-	DEBUG("begin write_to_bank:");
-	DEBUG(buf);
-	DEBUG_END();
-	DEBUG_INT(chunk_index);
-	DEBUG_END();
-	DEBUG_INT(size);
-	DEBUG_END();
-	DEBUG_INT(chunk_offset);
-	DEBUG_END();
-	void *tbank = bank[chunk_index / (CHUNK_NUM / BANK_NUM)];
-	int times = chunk_index % (CHUNK_NUM / BANK_NUM);
-	off_t offset = chunk_offset + times * CHUNK_SIZE;
-	size_t Tsize = chunk_offset + size + times * CHUNK_SIZE;
-	DEBUG("end write_to_bank:1");
-	memcpy(local_buf, tbank, offset);
-	DEBUG("end write_to_bank:2");
-	memcpy(local_buf + offset, buf, size);
-	DEBUG("end write_to_bank:3");
-	DEBUG(local_buf)
-	memcpy(tbank, local_buf, Tsize);
-	DEBUG("end write_to_bank:");
+static int hello_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	int res = -1;
+	src.buf[0].mem = (void *)buf;
+	if (head != NULL && head -> isDirectories != 1)
+		res = WriteFile(head, (struct open_file *)(uintptr_t)fi -> fh, &src, size, offset);
+	TRACE_END(t0, TR_WRITE, head ? head -> ino : 0, offset, size, res);
+	inode_put(head);
+	return res;
 }
 
-static int hello_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	DEBUG("begin write:");
-	DEBUG(buf);
-	DEBUG_END();
-	DEBUG_INT(size);
-	DEBUG_END();
-	DEBUG_INT(offset);
-	DEBUG_END();
-	char filename[FILE_NAME_LEN];
-	int len = strlen(path);
-	strcpy(filename, path);
-	filename[len] = '/';
-	filename[len + 1] = 0;
-	struct inode *head = get_father_inode(filename);
-	if (head == NULL || head -> isDirectories == 1) return -1;
-	struct context *cnt = head -> context;
-	if (cnt == NULL){
-		head -> context = malloc(sizeof(struct context));
-		cnt = head -> context;
-		cnt -> size = 0;
-		cnt -> chunk_index = getFreeChunk();
-		cnt -> next = NULL;
-	}
-	off_t write_offset = offset;
-	int i = write_offset / CHUNK_SIZE;
-	write_offset = write_offset % CHUNK_SIZE;
-	while (i > 0){
-		if (cnt == NULL) return 0;
-		if (cnt -> size != CHUNK_SIZE) return 0;
-		i--;
-		if (i == 0 && write_offset == 0 && cnt -> next == NULL){
-			cnt -> next = malloc(sizeof(struct context));
-			cnt -> next -> size = 0;
-			cnt -> next -> chunk_index = getFreeChunk();
-			cnt -> next -> next = NULL;
-		}
-		cnt = cnt -> next;
-	}
-	size_t write_size = 0, un_write_size = size;
-	while (un_write_size > 0){
-		if (un_write_size >= CHUNK_SIZE - write_offset){
-			Write_to_bank(cnt -> chunk_index, buf + write_size, (CHUNK_SIZE - write_offset), write_offset);
-			write_size += CHUNK_SIZE - write_offset;
-			un_write_size -= (CHUNK_SIZE - write_offset);
-			head -> size = head -> size - cnt -> size + CHUNK_SIZE;
-			write_offset = 0;
-			cnt -> size = CHUNK_SIZE;
-			if (cnt -> next == NULL && un_write_size > 0){
-				cnt -> next = malloc(sizeof(struct context));
-				cnt -> next -> size = 0;
-				cnt -> next -> chunk_index = getFreeChunk();
-				cnt -> next -> next = NULL;
-			}
-		} else {
-			Write_to_bank(cnt -> chunk_index, buf + write_size, un_write_size, write_offset);
-			write_size += un_write_size;
-			if (cnt -> size < write_offset){//modified
-				return 0;
-			}
-			if (cnt -> size < un_write_size + write_offset){
-				head -> size = head -> size - cnt -> size;
-				cnt -> size = un_write_size + write_offset;
-				head -> size += cnt -> size;
-			}
-			un_write_size = 0;
-		}
-	}
-	DEBUG("write finished");
-	return size;
+/* brief: write straight from the request buffer (often a spliced pipe)
+ * into chunk memory, one copy per byte */
+static int hello_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	int res = -1;
+	if (head != NULL && head -> isDirectories != 1)
+		res = WriteFile(head, (struct open_file *)(uintptr_t)fi -> fh, buf, fuse_buf_size(buf), offset);
+	TRACE_END(t0, TR_WRITE, head ? head -> ino : 0, offset, fuse_buf_size(buf), res);
+	inode_put(head);
+	return res;
 }
 
 static int hello_statfs(const char *path, struct statvfs *stbuf){
-	stbuf->f_bsize = BANK_SIZE;
+	uint64_t t0 = TRACE_BEGIN();
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = CHUNK_SIZE;
+	stbuf->f_frsize = CHUNK_SIZE;
+	stbuf->f_blocks = CHUNK_NUM - 1;
+	stbuf->f_bfree = __atomic_load_n(&chunk_free, __ATOMIC_RELAXED);
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_namemax = FILE_NAME_LEN - 2;
+	TRACE_END(t0, TR_STATFS, 0, 0, 0, 0);
 	return 0;
 }
 
@@ -716,60 +4224,184 @@ static int hello_chown(const char *path, uid_t uid, gid_t gid,
 
 static int hello_truncate(const char *path, off_t size,
 			struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	int res = SizeFile(head, 1, 0, size, 0);
+	TRACE_END(t0, TR_SETATTR, head ? head -> ino : 0, size, 0, res);
+	inode_put(head);
+	return res;
+}
+
+static int hello_fallocate(const char *path, int mode, off_t offset, off_t length,
+			   struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	int res = SizeFile(head, 0, mode, offset, length);
+	TRACE_END(t0, TR_FALLOCATE, head ? head -> ino : 0, offset, length, res);
+	inode_put(head);
+	return res;
+}
+
+static off_t hello_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = get_inode(path);
+	off_t res = SeekFile(head, off, whence);
+	TRACE_END(t0, TR_LSEEK, head ? head -> ino : 0, off, res > 0 ? res : 0, res < 0 ? res : 0);
+	inode_put(head);
+	return res;
+}
+
+/* brief: true when dir is up or lies below it, stable under rename_lock */
+int is_under(struct inode *dir, struct inode *up){
+	for (;dir != NULL;dir = __atomic_load_n(&dir -> father, __ATOMIC_ACQUIRE))
+		if (dir == up) return 1;
 	return 0;
 }
 
+/* brief: move oldname of oldfather to filename under father, replacing
+ * what is there; the two directories are locked ancestor first (by
+ * address when unrelated), a replaced directory after both of them */
+int RenameInode(struct inode *oldfather, const char *oldname, struct inode *father, const char *filename, unsigned int flag){
+	struct inode *head, *old = NULL, *first = oldfather, *second = NULL;
+	char *name;
+	long name_chunk;
+	int res = 0;
+	if (flag & RENAME_EXCHANGE) return -EINVAL;
+	if (oldfather == NULL || oldfather -> isDirectories != 1) return -ENOENT;
+	if (father == NULL || father -> isDirectories != 1) return -ENOENT;
+	if (strlen(filename) >= FILE_NAME_LEN - 1) return -ENAMETOOLONG;
+	if (oldfather -> readonly || father -> readonly) return -EROFS;
+	if ((oldfather == snap_inode) != (father == snap_inode)) return -EXDEV;
+	if ((name = name_get(filename, strlen(filename))) == NULL) return -ENOMEM;
+	if ((name_chunk = image_name_alloc(filename)) < 0){
+		name_put(name);
+		return -ENOSPC;
+	}
+	pthread_mutex_lock(&rename_lock);
+	if (father != oldfather){
+		second = father;
+		if (is_under(oldfather, father) || (!is_under(father, oldfather) && father < oldfather)){
+			first = father;
+			second = oldfather;
+		}
+	}
+	pthread_rwlock_wrlock(&first -> lock);
+	if (second != NULL) pthread_rwlock_wrlock(&second -> lock);
+	journal_begin();
+	head = dir_lookup(oldfather, oldname, strlen(oldname));
+	if (head == NULL || dir_dead(father)){
+		res = -ENOENT;
+		goto out;
+	}
+	if (is_under(father, head)){
+		res = -EINVAL;
+		goto out;
+	}
+	old = dir_lookup(father, filename, strlen(filename));
+	if (old == head){
+		old = NULL;
+		goto out;
+	}
+	if (head == stats_inode || old == stats_inode || head == snap_inode || old == snap_inode){
+		old = NULL;
+		res = -EPERM;
+		goto out;
+	}
+	if (old != NULL){
+		if (flag & RENAME_NOREPLACE) res = -EEXIST;
+		else if (old -> isDirectories == 1 && is_under(oldfather, old)) res = -ENOTEMPTY;
+		else if (old -> isDirectories == 1){
+			pthread_rwlock_wrlock(&old -> lock);
+			if (old -> son != NULL) res = -ENOTEMPTY;
+			else dir_unlink(father, old);
+			pthread_rwlock_unlock(&old -> lock);
+		} else {
+			dir_unlink(father, old);
+		}
+		if (res < 0){
+			old = NULL;
+			goto out;
+		}
+	}
+	dir_remove(oldfather, head);
+	oldfather -> timeLastModified = time(NULL);
+	/* readers hold rename_lock or a directory lock, the old name is
+	 * put once they are dropped */
+	char *prev = head -> filename;
+	head -> filename = name;
+	name = prev;
+	dir_insert(father, head);
+	father -> timeLastModified = time(NULL);
+	image_name(head, name_chunk);
+	image_data(oldfather);
+	image_data(father);
+	name_chunk = 0;
+out:
+	journal_end();
+	if (second != NULL) pthread_rwlock_unlock(&second -> lock);
+	pthread_rwlock_unlock(&first -> lock);
+	pthread_mutex_unlock(&rename_lock);
+	if (name_chunk > 0) putChunk(name_chunk);
+	name_put(name);
+	if (res == 0){
+		inval_entry(oldfather, oldname);
+		inval_entry(father, filename);
+		res = journal_sync();
+	}
+	if (old != NULL) DropInode(old);
+	return res;
+}
+
 static int hello_rename(const char *from, const char *to, unsigned int flag){
-	char filename[FILE_NAME_LEN], dirname[FILE_NAME_LEN], toname[FILE_NAME_LEN];
-	int len = strlen(from);
-	strcpy(filename, from);
-	filename[len] = '/';
-	filename[len + 1] = 0;
-	struct inode *head = get_father_inode(filename);
-	if (head == NULL){
-		return -17;
+	char filename[FILE_NAME_LEN], dirname[FILE_NAME_LEN];
+	char oldname[FILE_NAME_LEN], olddir[FILE_NAME_LEN];
+	struct inode *oldfather, *father;
+	int res;
+	if (strlen(from) <= 1){
+		return -ENOENT;
 	}
+	deal(from, olddir, oldname);
 	deal(to, dirname, filename);
-	strcpy(head -> filename, toname);
-	return 0;
+	uint64_t t0 = TRACE_BEGIN();
+	oldfather = get_father_inode(olddir);
+	father = get_father_inode(dirname);
+	res = RenameInode(oldfather, oldname, father, filename, flag);
+	TRACE_END(t0, TR_RENAME, 0, 0, 0, res);
+	inode_put(oldfather);
+	inode_put(father);
+	return res;
 }
 
 static int hello_create(const char *path, mode_t mode, struct fuse_file_info *fi){
-	DEBUG("begin create");
-	DEBUG(path);
-	DEBUG_END();
-	int res = CreateFile(path);
-	DEBUG_INT(res);
-	DEBUG_END();
-	if (res < 0){
-		return -1;
-	} else {
-		return 0;
-	}
+	uint64_t t0 = TRACE_BEGIN();
+	int res = CreateFile(path, fi);
+	TRACE_END(t0, TR_CREATE, 0, 0, 0, res < 0 ? res : 0);
+	return res < 0 ? res : 0;
 }
 
 static int hello_setxattr(const char *path, const char *name, const char *value, size_t size, int flag){
-	DEBUG("begin setxattr");
-	DEBUG(path);
-	DEBUG_END();
-	DEBUG(name);
-	DEBUG_END();
-	return 0;
+	uint64_t t0 = TRACE_BEGIN();
+	int res = trace_setxattr(name, value, size);
+	TRACE_END(t0, TR_SETXATTR, 0, 0, size, res);
+	return res;
 }
 
 static int hello_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi){
-	DEBUG("begin utimens");
-	DEBUG(path);
-	DEBUG_END();
+	uint64_t t0 = TRACE_BEGIN();
+	TRACE_END(t0, TR_UTIMENS, 0, 0, 0, 0);
 	return 0;
 }
 
 
 static struct fuse_operations hello_oper = {
 	.init           = hello_init,
+	.destroy	= hello_destroy,
 	.getattr	= hello_getattr,
 	.readdir	= hello_readdir,
 	.open		= hello_open,
+	/* no read_buf: libfuse replies after the callback returned and the
+	 * inode was unlocked, a chunk handed out as (fd, pos) may be freed
+	 * by then; hello_ll_read keeps the lock across its reply */
 	.read		= hello_read,
 	.access 	= hello_access,
 	.mknod 		= hello_mknod,
@@ -778,15 +4410,491 @@ static struct fuse_operations hello_oper = {
 	.rmdir 		= hello_rmdir,
 	.statfs		= hello_statfs,
 	.write 		= hello_write,
+	.write_buf	= hello_write_buf,
 	.chmod 		= hello_chmod,
 	.chown 		= hello_chown,
 	.truncate 	= hello_truncate,
+	.fallocate	= hello_fallocate,
+	.lseek		= hello_lseek,
 	.rename 	= hello_rename,
 	.create 	= hello_create,
 	.setxattr 	= hello_setxattr,
 	.utimens 	= hello_utimens,
+	.flush		= hello_flush,
+	.fsync		= hello_fsync,
+	.release	= hello_release,
+};
+
+/*
+ * Low-level front-end (--lowlevel)
+ *
+ * Requests carry the node id the kernel got from lookup, which is the
+ * inode number, so every operation resolves its inode with one
+ * table load instead of splitting and walking a path. The kernel does
+ * not forget a node while a request on it is in flight, so a node id
+ * stays valid for the whole request without taking a reference.
+ */
+
+
+/* brief: kernel lookups of an inode hold one reference between them */
+static void ll_lookup_get(struct inode *head){
+	if (__atomic_fetch_add(&head -> nlookup, 1, __ATOMIC_ACQ_REL) == 0)
+		inode_get(head);
+}
+
+static void ll_lookup_put(struct inode *head, uint64_t nlookup){
+	if (__atomic_sub_fetch(&head -> nlookup, nlookup, __ATOMIC_ACQ_REL) == 0)
+		inode_put(head);
+}
+
+static void ll_reply_entry(fuse_req_t req, struct inode *head, struct fuse_file_info *fi){
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = head -> ino;
+	e.generation = head -> generation;
+	e.attr_timeout = options.timeout;
+	e.entry_timeout = options.timeout;
+	fill_stat(head, &e.attr);
+	ll_lookup_get(head);
+	if (fi == NULL){
+		fuse_reply_entry(req, &e);
+	} else if (fuse_reply_create(req, &e, fi) != 0){
+		ll_lookup_put(head, 1);
+	}
+}
+
+static void hello_ll_init(void *userdata, struct fuse_conn_info *conn){
+	fs_init(conn);
+	if (options.cache)	/* here, after fuse_daemonize forked */
+		inval_start(*(struct fuse_session **)userdata, NULL);
+}
+
+static void hello_ll_destroy(void *userdata){
+	inval_end();
+	compress_end();
+	image_close();
+	trace_exit();
+}
+
+/* brief: fuse_reply_err that also closes the request's trace record */
+static void ll_reply_err(fuse_req_t req, uint64_t t0, int op, fuse_ino_t ino, int err){
+	TRACE_END(t0, op, ino, 0, 0, -err);
+	fuse_reply_err(req, err);
+}
+
+static void hello_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *father = ino_lookup(parent), *head;
+	if (father == NULL || father -> isDirectories != 1){
+		ll_reply_err(req, t0, TR_LOOKUP, parent, ENOTDIR);
+		return;
+	}
+	head = dir_get(father, name, strlen(name));
+	if (head == NULL){
+		ll_reply_err(req, t0, TR_LOOKUP, parent, ENOENT);
+		return;
+	}
+	TRACE_END(t0, TR_LOOKUP, head -> ino, 0, 0, 0);
+	ll_reply_entry(req, head, NULL);
+	inode_put(head);
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup){
+	struct inode *head = ino_lookup(ino);
+	if (head == NULL || head == root) return;
+	ll_lookup_put(head, nlookup);
+}
+
+static void hello_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup){
+	uint64_t t0 = TRACE_BEGIN();
+	ll_forget_one(ino, nlookup);
+	TRACE_END(t0, TR_FORGET, ino, 0, nlookup, 0);
+	fuse_reply_none(req);
+}
+
+static void hello_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets){
+	uint64_t t0 = TRACE_BEGIN();
+	size_t i;
+	for (i = 0;i < count;i++)
+		ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+	TRACE_END(t0, TR_FORGET, 0, 0, count, 0);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, int op){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = ino_lookup(ino);
+	struct stat st;
+	if (head == NULL){
+		ll_reply_err(req, t0, op, ino, ENOENT);
+		return;
+	}
+	fill_stat(head, &st);
+	TRACE_END(t0, op, ino, 0, 0, 0);
+	fuse_reply_attr(req, &st, options.timeout);
+}
+
+static void hello_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	ll_getattr(req, ino, TR_GETATTR);
+}
+
+static void hello_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			     int to_set, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	int res;
+	/* the size is applied, the rest like hello_chmod/hello_utimens: accepted, not applied */
+	if ((to_set & FUSE_SET_ATTR_SIZE) && (res = SizeFile(ino_lookup(ino), 1, 0, attr -> st_size, 0)) < 0){
+		ll_reply_err(req, t0, TR_SETATTR, ino, -res);
+		return;
+	}
+	ll_getattr(req, ino, TR_SETATTR);
+}
+
+static void hello_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+			       struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	int res = SizeFile(ino_lookup(ino), 0, mode, offset, length);
+	TRACE_END(t0, TR_FALLOCATE, ino, offset, length, res);
+	fuse_reply_err(req, -res);
+}
+
+static void hello_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			   struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	off_t res = SeekFile(ino_lookup(ino), off, whence);
+	if (res < 0){
+		ll_reply_err(req, t0, TR_LSEEK, ino, -res);
+		return;
+	}
+	fuse_reply_lseek(req, res);
+	TRACE_END(t0, TR_LSEEK, ino, off, res, 0);
+}
+
+static void ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, char isDirectories,
+		    struct fuse_file_info *fi, int op){
+	uint64_t t0 = TRACE_BEGIN();
+	int err;
+	struct inode *head = MakeNode(ino_lookup(parent), name, isDirectories, &err);
+	if (head == NULL){
+		ll_reply_err(req, t0, op, parent, -err);
+		return;
+	}
+	if (fi != NULL){
+		open_file_new(fi, head);
+		fi -> keep_cache = options.cache;
+	}
+	TRACE_END(t0, op, head -> ino, 0, 0, 0);
+	ll_reply_entry(req, head, fi);
+	inode_put(head);
+}
+
+static void hello_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			   mode_t mode, dev_t rdev){
+	if (!S_ISREG(mode)){
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	ll_make(req, parent, name, 0, NULL, TR_MKNOD);
+}
+
+static void hello_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+	ll_make(req, parent, name, 1, NULL, TR_MKDIR);
+}
+
+static void hello_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			    mode_t mode, struct fuse_file_info *fi){
+	ll_make(req, parent, name, 0, fi, TR_CREATE);
+}
+
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, char isDirectories){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *father = ino_lookup(parent), *head;
+	int err = 0;
+	int op = isDirectories ? TR_RMDIR : TR_UNLINK;
+	if (father == NULL || father -> isDirectories != 1){
+		ll_reply_err(req, t0, op, parent, ENOTDIR);
+		return;
+	}
+	if (father -> readonly){
+		ll_reply_err(req, t0, op, parent, EROFS);
+		return;
+	}
+	pthread_rwlock_wrlock(&father -> lock);
+	head = dir_lookup(father, name, strlen(name));
+	if (head == NULL){
+		err = ENOENT;
+	} else if (head == stats_inode || head == snap_inode){
+		err = EPERM;
+	} else if (head -> isDirectories != isDirectories){
+		err = isDirectories ? ENOTDIR : EISDIR;
+	} else if (isDirectories){
+		/* a snapshot goes in one rmdir, its tree is emptied below */
+		pthread_rwlock_wrlock(&head -> lock);
+		if (head -> son != NULL && father != snap_inode) err = ENOTEMPTY;
+		else dir_unlink(father, head);
+		pthread_rwlock_unlock(&head -> lock);
+	} else {
+		dir_unlink(father, head);
+	}
+	pthread_rwlock_unlock(&father -> lock);
+	if (err == 0){
+		inval_entry(father, name);
+		if (father == snap_inode) DeleteAll(head);
+		DropInode(head);
+		err = -journal_sync();
+	}
+	ll_reply_err(req, t0, op, parent, err);
+}
+
+static void hello_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+	ll_remove(req, parent, name, 0);
+}
+
+static void hello_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+	ll_remove(req, parent, name, 1);
+}
+
+static void hello_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			    fuse_ino_t newparent, const char *newname, unsigned int flags){
+	uint64_t t0 = TRACE_BEGIN();
+	int res = RenameInode(ino_lookup(parent), name, ino_lookup(newparent), newname, flags);
+	ll_reply_err(req, t0, TR_RENAME, parent, -res);
+}
+
+static void hello_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = ino_lookup(ino);
+	if (head == NULL){
+		ll_reply_err(req, t0, TR_OPEN, ino, ENOENT);
+		return;
+	}
+	if (head -> isDirectories == 1){
+		ll_reply_err(req, t0, TR_OPEN, ino, EISDIR);
+		return;
+	}
+	if (head == stats_inode){
+		int res = OpenStats(fi);
+		if (res < 0){
+			ll_reply_err(req, t0, TR_OPEN, ino, -res);
+			return;
+		}
+	} else if (head -> readonly && (fi -> flags & O_ACCMODE) != O_RDONLY){
+		ll_reply_err(req, t0, TR_OPEN, ino, EROFS);
+		return;
+	} else {
+		open_file_new(fi, head);
+		fi -> keep_cache = options.cache;
+	}
+	TRACE_END(t0, TR_OPEN, ino, 0, 0, 0);
+	fuse_reply_open(req, fi);
+}
+
+/* brief: the trace record covers the reply; the kernel copies or
+ * splices the chunks while fuse_reply_data runs, so the inode stays
+ * locked until it has returned */
+static void hello_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			  struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = ino_lookup(ino);
+	struct fuse_bufvec *bv;
+	int res;
+	if (head == NULL || head -> isDirectories == 1){
+		ll_reply_err(req, t0, TR_READ, ino, head == NULL ? ENOENT : EISDIR);
+		return;
+	}
+	res = ReadInodeBuf(head, &bv, size, offset);
+	if (res < 0){
+		ll_reply_err(req, t0, TR_READ, ino, -res);
+		return;
+	}
+	fuse_reply_data(req, bv, 0);
+	TRACE_END(t0, TR_READ, ino, offset, fuse_buf_size(bv), 0);
+	ReadInodeBufDone(head, bv);
+}
+
+static void hello_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			       off_t offset, struct fuse_file_info *fi){
+	uint64_t t0 = TRACE_BEGIN();
+	struct inode *head = ino_lookup(ino);
+	int res;
+	if (head == NULL || head -> isDirectories == 1){
+		ll_reply_err(req, t0, TR_WRITE, ino, head == NULL ? ENOENT : EISDIR);
+		return;
+	}
+	res = WriteFile(head, (struct open_file *)(uintptr_t)fi -> fh, bufv, fuse_buf_size(bufv), offset);
+	TRACE_END(t0, TR_WRITE, ino, offset, fuse_buf_size(bufv), res);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+static void hello_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	fuse_reply_err(req, -hello_flush(NULL, fi));
+}
+
+static void hello_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+	fuse_reply_err(req, -hello_fsync(NULL, datasync, fi));
+}
+
+static void hello_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	fuse_reply_err(req, -hello_release(NULL, fi));
+}
+
+/* brief: offset is a cookie, see dir_insert; with plus every entry
+ * but "." and ".." is a lookup the kernel will forget, as from
+ * hello_ll_lookup */
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus){
+	uint64_t t0 = TRACE_BEGIN();
+	int op = plus ? TR_READDIRPLUS : TR_READDIR;
+	struct inode *dir = ino_lookup(ino), *now = NULL;
+	struct fuse_entry_param e;
+	char *buf;
+	size_t used = 0, len;
+	off_t i;
+	if (dir == NULL || dir -> isDirectories != 1){
+		ll_reply_err(req, t0, op, ino, ENOTDIR);
+		return;
+	}
+	buf = malloc(size);
+	if (buf == NULL){
+		ll_reply_err(req, t0, op, ino, ENOMEM);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	pthread_rwlock_rdlock(&dir -> lock);
+	for (i = offset;i < 2;i++){
+		e.attr.st_ino = (i == 0 || dir -> father == NULL) ? dir -> ino : dir -> father -> ino;
+		e.attr.st_mode = S_IFDIR;
+		if (plus) len = fuse_add_direntry_plus(req, buf + used, size - used, i == 0 ? "." : "..", &e, i + 1);
+		else len = fuse_add_direntry(req, buf + used, size - used, i == 0 ? "." : "..", &e.attr, i + 1);
+		if (len > size - used) goto out;
+		used += len;
+	}
+	for (now = dir_seek(dir, offset);now != NULL;now = now -> bro){
+		if (plus){
+			e.ino = now -> ino;
+			e.generation = now -> generation;
+			e.attr_timeout = options.timeout;
+			e.entry_timeout = options.timeout;
+			fill_stat(now, &e.attr);
+			len = fuse_add_direntry_plus(req, buf + used, size - used, now -> filename, &e, now -> dpos);
+		} else {
+			e.attr.st_ino = now -> ino;
+			e.attr.st_mode = (now -> isDirectories == 1) ? S_IFDIR : S_IFREG;
+			len = fuse_add_direntry(req, buf + used, size - used, now -> filename, &e.attr, now -> dpos);
+		}
+		if (len > size - used) break;
+		if (plus) ll_lookup_get(now);
+		used += len;
+	}
+	dir_stop(dir, now);
+out:
+	pthread_rwlock_unlock(&dir -> lock);
+	TRACE_END(t0, op, ino, offset, used, 0);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void hello_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			     struct fuse_file_info *fi){
+	ll_readdir(req, ino, size, offset, 0);
+}
+
+static void hello_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				 struct fuse_file_info *fi){
+	ll_readdir(req, ino, size, offset, 1);
+}
+
+static void hello_ll_statfs(fuse_req_t req, fuse_ino_t ino){
+	struct statvfs st;
+	hello_statfs(NULL, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+static void hello_ll_access(fuse_req_t req, fuse_ino_t ino, int mask){
+	fuse_reply_err(req, ino_lookup(ino) == NULL ? ENOENT : 0);
+}
+
+static void hello_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			      const char *value, size_t size, int flags){
+	uint64_t t0 = TRACE_BEGIN();
+	ll_reply_err(req, t0, TR_SETXATTR, ino, -trace_setxattr(name, value, size));
+}
+
+static struct fuse_lowlevel_ops hello_ll_oper = {
+	.init		= hello_ll_init,
+	.destroy	= hello_ll_destroy,
+	.lookup		= hello_ll_lookup,
+	.forget		= hello_ll_forget,
+	.forget_multi	= hello_ll_forget_multi,
+	.getattr	= hello_ll_getattr,
+	.setattr	= hello_ll_setattr,
+	.mknod		= hello_ll_mknod,
+	.mkdir		= hello_ll_mkdir,
+	.create		= hello_ll_create,
+	.unlink		= hello_ll_unlink,
+	.rmdir		= hello_ll_rmdir,
+	.rename		= hello_ll_rename,
+	.open		= hello_ll_open,
+	.read		= hello_ll_read,
+	.write_buf	= hello_ll_write_buf,
+	.flush		= hello_ll_flush,
+	.fsync		= hello_ll_fsync,
+	.release	= hello_ll_release,
+	.readdir	= hello_ll_readdir,
+	.readdirplus	= hello_ll_readdirplus,
+	.fallocate	= hello_ll_fallocate,
+	.lseek		= hello_ll_lseek,
+	.statfs		= hello_ll_statfs,
+	.access		= hello_ll_access,
+	.setxattr	= hello_ll_setxattr,
 };
 
+static int ll_main(struct fuse_args *args){
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+	if (opts.show_help){
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto out1;
+	} else if (opts.show_version){
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out1;
+	}
+	if (opts.mountpoint == NULL){
+		printf("usage: hello --lowlevel [options] <mountpoint>\n");
+		goto out1;
+	}
+
+	se = fuse_session_new(args, &hello_ll_oper, sizeof(hello_ll_oper), &se);
+	if (se == NULL)
+		goto out1;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out2;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out3;
+
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread)
+		ret = fuse_session_loop(se);
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
+
+	fuse_session_unmount(se);
+out3:
+	fuse_remove_signal_handlers(se);
+out2:
+	fuse_session_destroy(se);
+out1:
+	free(opts.mountpoint);
+	return ret ? 1 : 0;
+}
+
 static void show_help(const char *progname)
 {
 	printf("usage: %s [options] <mountpoint>\n\n", progname);
@@ -795,6 +4903,22 @@ static void show_help(const char *progname)
 	       "                        (default: \"hello\")\n"
 	       "    --contents=<s>      Contents \"hello\" file\n"
 	       "                        (default \"Hello, World!\\n\")\n"
+	       "    --write-buffer=<n>  Per open file write-combining buffer\n"
+	       "                        in bytes (default: 0, disabled)\n"
+	       "    --lowlevel          Serve the low-level API, operations are\n"
+	       "                        resolved by inode number instead of path\n"
+	       "    --cache             Keep file pages in the kernel across opens,\n"
+	       "                        engine side changes are invalidated\n"
+	       "    --timeout=<s>       Entry and attribute timeout in seconds\n"
+	       "                        (default: 1, 60 with --cache)\n"
+	       "    --writeback         Let the kernel cache writes (writeback cache)\n"
+	       "    --trace=<n>         Trace level: 0 off, 1 requests, 2 engine\n"
+	       "                        events; binary records go to " TRACE_FILE "\n"
+	       "                        (setxattr " TRACE_XATTR " changes it live)\n"
+	       "    --image=<file>      Keep the file system in <file> (created if\n"
+	       "                        missing) so it survives restarts\n"
+	       "    --dedup             Store identical full chunks once\n"
+	       "    --compress=<s>      Compress chunks not written for <s> seconds\n"
 	       "\n");
 }
 
@@ -808,10 +4932,13 @@ int main(int argc, char *argv[])
 	   values are specified */
 	options.filename = strdup("hello");
 	options.contents = strdup("Hello World!\n");
+	options.timeout = -1;
 
 	/* Parse options */
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
 		return 1;
+	if (options.timeout < 0)
+		options.timeout = options.cache ? 60.0 : 1.0;
 
 	/* When --help is specified, first print our own file-system
 	   specific help text, then signal fuse_main to show
@@ -824,14 +4951,14 @@ int main(int argc, char *argv[])
 		args.argv[0][0] = '\0';
 	}
 
-	#ifdef DEBUG_ON
-		fp = fopen(DEBUG_FILE, "w");
-		fclose(fp);
-		fp = fopen(DEBUG_FILE, "ab+");
-	#endif
-	local_buf = malloc(BANK_SIZE+1);
+	trace_level = options.trace;
+	if (options.image != NULL && !options.show_help && image_open(options.image) < 0)
+		return 1;
 
-	ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	if (options.lowlevel)
+		ret = ll_main(&args);
+	else
+		ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
 	fuse_opt_free_args(&args);
 	return ret;
 }
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * bench [-s MB] [-t threads] dir...
+ *
+ * Runs the read/write step sizes of read.c and write.c, plus random,
+ * append and multi-threaded variants, against a file in each dir (a
+ * mounted hello.c, tmpfs, ext4, ...) and prints one CSV line per
+ * (dir, test, step). Latencies are per read/write/memcpy call.
+ */
+
+const int try_step[7] = {128, 256, 512, 1024, 2048, 4096, 8192};
+
+enum kind {
+	SEQ_WRITE, SEQ_READ, MMAP_WRITE, MMAP_READ,
+	RAND_WRITE, RAND_READ, APPEND, MT_WRITE, MT_READ,
+};
+
+struct test {
+	const char *name;
+	enum kind kind;
+	int threaded;
+} tests[] = {
+	{"write", SEQ_WRITE, 0},
+	{"read", SEQ_READ, 0},
+	{"mmap-write", MMAP_WRITE, 0},
+	{"mmap-read", MMAP_READ, 0},
+	{"rand-write", RAND_WRITE, 0},
+	{"rand-read", RAND_READ, 0},
+	{"append", APPEND, 0},
+	{"mt-write", MT_WRITE, 1},
+	{"mt-read", MT_READ, 1},
+};
+
+/* brief: one thread's share of a test, ops calls of step bytes from first */
+struct job {
+	enum kind kind;
+	int fd;
+	char *map;
+	int step;
+	long first;
+	long ops;
+	uint64_t seed;
+	uint32_t *lat;		/* ns per call */
+	int err;
+};
+
+long file_size = 64 * 1024 * 1024;
+int nthreads = 4;
+char *c;
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* brief: xorshift64, the same offsets on every filesystem */
+uint64_t next_rand(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+void *run_job(void *arg) {
+	struct job *j = arg;
+	long nblk = file_size / j->step;
+
+	for (long i = 0; i < j->ops; i++) {
+		long off = j->first + i * j->step;
+		ssize_t n = j->step;
+		uint64_t t0;
+
+		if (j->kind == RAND_WRITE || j->kind == RAND_READ)
+			off = (long)(next_rand(&j->seed) % nblk) * j->step;
+		t0 = now_ns();
+		switch (j->kind) {
+		case SEQ_WRITE:
+		case APPEND:
+			n = write(j->fd, c + off, j->step);
+			break;
+		case SEQ_READ:
+			n = read(j->fd, c + off, j->step);
+			break;
+		case MMAP_WRITE:
+			memcpy(j->map + off, c + off, j->step);
+			break;
+		case MMAP_READ:
+			memcpy(c + off, j->map + off, j->step);
+			break;
+		case RAND_WRITE:
+		case MT_WRITE:
+			n = pwrite(j->fd, c + off, j->step, off);
+			break;
+		case RAND_READ:
+		case MT_READ:
+			n = pread(j->fd, c + off, j->step, off);
+			break;
+		}
+		j->lat[i] = now_ns() - t0;
+		if (n != j->step) {
+			j->err = n < 0 ? errno : EIO;
+			j->ops = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+double pct_us(uint32_t *lat, long n, double q) {
+	long i = (long)(q * n);
+	if (i >= n) i = n - 1;
+	return lat[i] / 1000.0;
+}
+
+/* brief: open (and map) the file the test needs, -1 on failure */
+int open_test(struct test *t, const char *file, const char *append_file, char **map) {
+	int fd;
+
+	*map = NULL;
+	switch (t->kind) {
+	case SEQ_WRITE:
+		unlink(file);
+		fd = open(file, O_CREAT | O_RDWR, S_IRWXU);
+		break;
+	case APPEND:
+		unlink(append_file);
+		fd = open(append_file, O_CREAT | O_WRONLY | O_APPEND, S_IRWXU);
+		break;
+	default:
+		fd = open(file, O_RDWR);
+		break;
+	}
+	if (fd == -1) {
+		fprintf(stderr, "fail on open %s: %s\n", t->kind == APPEND ? append_file : file, strerror(errno));
+		return -1;
+	}
+	if (t->kind == MMAP_WRITE || t->kind == MMAP_READ) {
+		int prot = t->kind == MMAP_WRITE ? PROT_READ | PROT_WRITE : PROT_READ;
+		*map = mmap(NULL, file_size, prot, MAP_SHARED, fd, 0);
+		if (*map == MAP_FAILED) {
+			fprintf(stderr, "fail on mmap %s: %s\n", file, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* brief: run one (test, step) and print its CSV line, the time covers
+ * the calls and the final fsync/msync of a write test */
+int run_test(const char *dir, struct test *t, int step, uint32_t *lat) {
+	char file[4096], append_file[4096];
+	int threads = t->threaded ? nthreads : 1;
+	long ops = file_size / step, done = 0;
+	struct job job[threads];
+	pthread_t tid[threads];
+	uint64_t start, end;
+	char *map;
+	int fd, err = 0;
+
+	snprintf(file, sizeof(file), "%s/bench.tmp", dir);
+	snprintf(append_file, sizeof(append_file), "%s/bench-append.tmp", dir);
+	fd = open_test(t, file, append_file, &map);
+	if (fd == -1)
+		return -1;
+
+	for (int i = 0; i < threads; i++) {
+		long share = ops / threads + (i < ops % threads);
+		job[i] = (struct job){t->kind, fd, map, step, done * step, share, 0x9e3779b97f4a7c15ULL * (i + 1), lat + done, 0};
+		done += share;
+	}
+	start = now_ns();
+	if (threads == 1) {
+		run_job(&job[0]);
+	} else {
+		for (int i = 0; i < threads; i++)
+			pthread_create(&tid[i], NULL, run_job, &job[i]);
+		for (int i = 0; i < threads; i++)
+			pthread_join(tid[i], NULL);
+	}
+	if (t->kind == MMAP_WRITE)
+		msync(map, file_size, MS_SYNC);
+	else if (t->kind == SEQ_WRITE || t->kind == RAND_WRITE || t->kind == APPEND || t->kind == MT_WRITE)
+		fsync(fd);
+	end = now_ns();
+	if (map != NULL)
+		munmap(map, file_size);
+	close(fd);
+
+	/* pack the latencies of every job, a short job leaves a gap */
+	done = 0;
+	for (int i = 0; i < threads; i++) {
+		memmove(lat + done, job[i].lat, job[i].ops * sizeof(uint32_t));
+		done += job[i].ops;
+		if (job[i].err != 0)
+			err = job[i].err;
+	}
+	if (err != 0)
+		fprintf(stderr, "%s %s step %d: %s after %ld calls\n", dir, t->name, step, strerror(err), done);
+	if (done == 0)
+		return -1;
+	qsort(lat, done, sizeof(uint32_t), cmp_u32);
+
+	double sec = (end - start) * 1e-9;
+	double bytes = (double)done * step;
+	printf("%s,%s,%d,%d,%.0f,%.6f,%.2f,%.3f,%.3f,%.3f,%.3f\n", dir, t->name, step, threads, bytes, sec,
+	       bytes / sec / (1024 * 1024), pct_us(lat, done, 0.5), pct_us(lat, done, 0.9),
+	       pct_us(lat, done, 0.99), lat[done - 1] / 1000.0);
+	fflush(stdout);
+	return err != 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, ret = 0;
+	uint32_t *lat;
+
+	while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			file_size = atol(optarg) * 1024 * 1024;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc || file_size <= 0 || nthreads <= 0)
+		goto usage;
+
+	c = malloc(file_size);
+	lat = malloc(file_size / try_step[0] * sizeof(uint32_t));
+	if (c == NULL || lat == NULL) {
+		fprintf(stderr, "fail on malloc\n");
+		return 1;
+	}
+	for (long i = 0; i < file_size; i++)
+		c[i] = '#';
+
+	printf("fs,test,step,threads,bytes,seconds,mb_per_s,p50_us,p90_us,p99_us,max_us\n");
+	for (int d = optind; d < argc; d++) {
+		char file[4096];
+		for (int i = 6; i >= 0; i--)
+			for (int k = 0; k < (int)(sizeof(tests) / sizeof(tests[0])); k++)
+				if (run_test(argv[d], &tests[k], try_step[i], lat) < 0)
+					ret = 1;
+		snprintf(file, sizeof(file), "%s/bench.tmp", argv[d]);
+		unlink(file);
+		snprintf(file, sizeof(file), "%s/bench-append.tmp", argv[d]);
+		unlink(file);
+	}
+	free(lat);
+	free(c);
+	return ret;
+
+usage:
+	fprintf(stderr, "usage: %s [-s MB] [-t threads] dir...\n", argv[0]);
+	return 2;
+}